@@ -0,0 +1,187 @@
+#ifndef _ALIGNMENT_SCHEDULER_H_
+#define _ALIGNMENT_SCHEDULER_H_
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <condition_variable>
+
+namespace Sibelia
+{
+	// Hands out block alignment tasks to the threads over a window of blocks
+	// that slides as their alignments are written. A block entering the
+	// window is first given to a thread to estimate its memory, and then the
+	// estimated blocks are aligned largest first, so the longest alignments
+	// start early and do not hold the window. With a budget, a block is
+	// admitted only while the estimates of the running blocks and its own fit
+	// into it; a block larger than the whole budget waits until nothing else
+	// runs and then runs alone. The estimates are not bounds, so a block that
+	// failed next to others is retried once alone, and nothing else starts
+	// until that retry is done.
+	class AlignmentScheduler
+	{
+	public:
+		enum Action
+		{
+			ESTIMATE,
+			ALIGN,
+			FINISH
+		};
+
+		AlignmentScheduler(size_t tasks, size_t window, size_t budget) : tasks_(tasks), window_(window), budget_(budget),
+			claimed_(0), limit_(std::min(tasks, window)), running_(0), used_(0), deferred_(0), retried_(0), admitted_(0),
+			alone_(false), memory_(window), start_(window), again_(window)
+		{
+
+		}
+
+		// Waits for the next thing to do, the task is the number of the block
+		Action Next(size_t & task)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			while (true)
+			{
+				if (!retry_.empty())
+				{
+					if (running_ == 0)
+					{
+						task = retry_.front();
+						retry_.erase(retry_.begin());
+						alone_ = true;
+						Admit(task);
+						return ALIGN;
+					}
+				}
+				else if (!alone_)
+				{
+					for (auto it = ready_.begin(); it != ready_.end(); ++it)
+					{
+						size_t memory = memory_[*it % window_];
+						if (budget_ == 0 || used_ + memory <= budget_ || running_ == 0)
+						{
+							task = *it;
+							deferred_ += budget_ > 0 && memory > budget_ ? 1 : 0;
+							ready_.erase(it);
+							Admit(task);
+							return ALIGN;
+						}
+					}
+				}
+
+				if (claimed_ < limit_)
+				{
+					task = claimed_++;
+					return ESTIMATE;
+				}
+
+				if (claimed_ == tasks_ && ready_.empty() && retry_.empty())
+				{
+					return FINISH;
+				}
+
+				change_.wait(lock);
+			}
+		}
+
+		void Estimated(size_t task, size_t memory)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				memory_[task % window_] = memory;
+				again_[task % window_] = false;
+				auto it = ready_.begin();
+				for (; it != ready_.end() && memory_[*it % window_] >= memory; ++it);
+				ready_.insert(it, task);
+			}
+
+			change_.notify_all();
+		}
+
+		// Marks the alignment of the task as finished, with the given number of
+		// blocks already written
+		void Done(size_t task, size_t written)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				Release(task);
+				limit_ = std::max(limit_, std::min(tasks_, written + window_));
+			}
+
+			change_.notify_all();
+		}
+
+		// Called instead of Done when the alignment of the task failed. Returns
+		// true if the task is put back to be aligned alone, and false if it
+		// already ran alone, so it failed for good
+		bool Retry(size_t task)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				size_t slot = task % window_;
+				if (again_[slot] || start_[slot] == admitted_)
+				{
+					return false;
+				}
+
+				Release(task);
+				again_[slot] = true;
+				retry_.push_back(task);
+				retried_++;
+			}
+
+			change_.notify_all();
+			return true;
+		}
+
+		// The number of blocks over the budget that were run alone
+		size_t Deferred() const
+		{
+			return deferred_;
+		}
+
+		// The number of blocks that failed next to others and were retried alone
+		size_t Retried() const
+		{
+			return retried_;
+		}
+
+	private:
+		// The admission number of a task tells if it ran alone: nothing ran
+		// when it started and nothing started after it
+		void Admit(size_t task)
+		{
+			admitted_++;
+			used_ += memory_[task % window_];
+			start_[task % window_] = running_++ == 0 ? admitted_ : 0;
+		}
+
+		void Release(size_t task)
+		{
+			used_ -= memory_[task % window_];
+			running_--;
+			alone_ = false;
+		}
+
+		size_t tasks_;
+		size_t window_;
+		size_t budget_;
+		size_t claimed_;
+		size_t limit_;
+		size_t running_;
+		size_t used_;
+		size_t deferred_;
+		size_t retried_;
+		size_t admitted_;
+		bool alone_;
+		std::vector<size_t> memory_;
+		std::vector<size_t> start_;
+		std::vector<bool> again_;
+		std::vector<size_t> ready_;
+		std::vector<size_t> retry_;
+		std::mutex mutex_;
+		std::condition_variable change_;
+	};
+}
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef _BLOCK_ALIGNER_H_
+#define _BLOCK_ALIGNER_H_
+
+#include <cassert>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _USE_SPOA_
+#include "spoa/spoa.hpp"
+#endif
+
+namespace Sibelia
+{
+	// Global multiple alignment of the copies of a block by partial order
+	// alignment with the same scores the sibeliaz script passes to spoa:
+	// global mode, linear gaps, match 5, mismatch -4, gap -8. An instance
+	// keeps the DP matrices of spoa between the calls, so every thread
+	// should have its own
+	class BlockAligner
+	{
+	public:
+		static bool Available()
+		{
+#ifdef _USE_SPOA_
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		BlockAligner()
+		{
+#ifdef _USE_SPOA_
+			engine_ = spoa::AlignmentEngine::Create(spoa::AlignmentType::kNW, MATCH, MISMATCH, GAP, GAP, GAP_OPEN_SECOND, GAP_EXTEND_SECOND);
+#else
+			throw std::runtime_error("sibeliaz-lcb was built without spoa");
+#endif
+		}
+
+		// Estimate of the memory taken by the alignment: spoa keeps a score for
+		// every pair of a graph node and a character of the copy being aligned.
+		// The copies of a block are similar, so the graph gets about as many
+		// nodes as the longest copy plus what the diverged parts add, assumed to
+		// be GRAPH_GROWTH times the longest copy and never more than all the
+		// characters. It is not a bound: diverged copies can take more, up to
+		// all the characters. Also counts the copies and the rows of the result
+		static size_t MemoryEstimate(size_t copies, size_t totalLength, size_t maxLength)
+		{
+			size_t nodes = std::min(totalLength, GRAPH_GROWTH * maxLength);
+			return (nodes + 1) * (maxLength + 1) * sizeof(int32_t) + 2 * copies * (maxLength + 1);
+		}
+
+		// Estimate of the memory taken by the anchored alignment: only one
+		// window between two anchors is aligned at a time
+		static size_t AnchoredMemoryEstimate(const std::vector<size_t> & length, const std::vector<size_t> & anchor, size_t anchorLength)
+		{
+			size_t copies = length.size();
+			size_t ret = 0;
+			size_t maxLength = 0;
+			std::vector<size_t> prev(copies, 0);
+			for (size_t a = 0; a <= anchor.size() / copies; a++)
+			{
+				size_t windowTotal = 0;
+				size_t windowMax = 0;
+				for (size_t c = 0; c < copies; c++)
+				{
+					size_t end = a < anchor.size() / copies ? anchor[a * copies + c] : length[c];
+					windowTotal += end - prev[c];
+					windowMax = std::max(windowMax, end - prev[c]);
+					prev[c] = end + anchorLength;
+					maxLength = std::max(maxLength, length[c]);
+				}
+
+				ret = std::max(ret, MemoryEstimate(copies, windowTotal, windowMax));
+			}
+
+			return ret + 2 * copies * (maxLength + 1);
+		}
+
+		// Aligns the sequences split by anchors, exact matches of anchorLength
+		// characters starting at anchor[a * copies + c] in the sequence c, in
+		// increasing order. Only the windows between the anchors are aligned,
+		// and the anchors are put into the rows as gapless columns, so the
+		// memory depends on the longest window instead of the whole block
+		bool AlignAnchored(const std::vector<std::string> & sequence, const std::vector<size_t> & anchor, size_t anchorLength, std::vector<std::string> & row)
+		{
+			size_t copies = sequence.size();
+			std::vector<size_t> prev(copies, 0);
+			std::vector<std::string> segment(copies);
+			std::vector<std::string> segmentRow;
+			row.assign(copies, std::string());
+			for (size_t a = 0; a <= anchor.size() / copies; a++)
+			{
+				bool last = a == anchor.size() / copies;
+				for (size_t c = 0; c < copies; c++)
+				{
+					size_t end = last ? sequence[c].size() : anchor[a * copies + c];
+					segment[c].assign(sequence[c], prev[c], end - prev[c]);
+				}
+
+				if (!AlignWindow(segment, segmentRow))
+				{
+					row.clear();
+					return false;
+				}
+
+				for (size_t c = 0; c < copies; c++)
+				{
+					row[c] += segmentRow[c];
+					if (!last)
+					{
+						assert(sequence[c].compare(anchor[a * copies + c], anchorLength, sequence[0], anchor[a * copies], anchorLength) == 0);
+						row[c].append(sequence[c], anchor[a * copies + c], anchorLength);
+						prev[c] = anchor[a * copies + c] + anchorLength;
+					}
+				}
+			}
+
+			return true;
+		}
+
+		// Fills the rows of the alignment in the order of the sequences,
+		// returns false if spoa failed, e.g. the alignment did not fit in
+		// memory, which spoa reports as std::invalid_argument
+		bool Align(const std::vector<std::string> & sequence, std::vector<std::string> & row)
+		{
+#ifdef _USE_SPOA_
+			try
+			{
+				spoa::Graph graph;
+				for (const std::string & seq : sequence)
+				{
+					spoa::Alignment alignment = engine_->Align(seq, graph);
+					graph.AddAlignment(alignment, seq);
+				}
+
+				row = graph.GenerateMultipleSequenceAlignment();
+				return true;
+			}
+			catch (std::exception &)
+			{
+				row.clear();
+				return false;
+			}
+#else
+			(void)sequence;
+			row.clear();
+			return false;
+#endif
+		}
+
+	private:
+		// Aligns a window where some of the segments may be empty, they get
+		// rows of gaps. Equal segments are put into the rows as they are
+		bool AlignWindow(const std::vector<std::string> & segment, std::vector<std::string> & row)
+		{
+			std::vector<size_t> present;
+			for (size_t c = 0; c < segment.size(); c++)
+			{
+				if (!segment[c].empty())
+				{
+					present.push_back(c);
+				}
+			}
+
+			row.assign(segment.size(), std::string());
+			if (present.empty())
+			{
+				return true;
+			}
+
+			bool equal = true;
+			for (size_t c : present)
+			{
+				equal = equal && segment[c] == segment[present[0]];
+			}
+
+			if (equal)
+			{
+				for (size_t c = 0; c < segment.size(); c++)
+				{
+					row[c] = segment[c].empty() ? std::string(segment[present[0]].size(), '-') : segment[c];
+				}
+
+				return true;
+			}
+
+			std::vector<std::string> sequence;
+			std::vector<std::string> aligned;
+			for (size_t c : present)
+			{
+				sequence.push_back(segment[c]);
+			}
+
+			if (!Align(sequence, aligned) || aligned.size() < present.size())
+			{
+				return false;
+			}
+
+			for (size_t i = 0; i < present.size(); i++)
+			{
+				row[present[i]].swap(aligned[i]);
+			}
+
+			for (size_t c = 0; c < segment.size(); c++)
+			{
+				if (segment[c].empty())
+				{
+					row[c].assign(row[present[0]].size(), '-');
+				}
+			}
+
+			return true;
+		}
+
+		static const size_t GRAPH_GROWTH = 2;
+		static const int8_t MATCH = 5;
+		static const int8_t MISMATCH = -4;
+		static const int8_t GAP = -8;
+		static const int8_t GAP_OPEN_SECOND = -10;
+		static const int8_t GAP_EXTEND_SECOND = -4;
+#ifdef _USE_SPOA_
+		std::unique_ptr<spoa::AlignmentEngine> engine_;
+#endif
+	};
+}
+
+#endif
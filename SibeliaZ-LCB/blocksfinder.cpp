@@ -1,5 +1,9 @@
 #include "blocksfinder.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 namespace Sibelia
 {
 #include <errno.h>
@@ -26,7 +30,23 @@ namespace Sibelia
 		}
 	}
 
+	size_t ResidentMemory()
+	{
+		size_t pages = 0;
+		size_t resident = 0;
+#ifndef _WIN32
+		std::ifstream statm("/proc/self/statm");
+		if (statm >> pages >> resident)
+		{
+			return resident * size_t(sysconf(_SC_PAGESIZE));
+		}
+#endif
+		return 0;
+	}
+
 	JunctionStorage * JunctionStorage::this_;
+	uint32_t JunctionStorage::usedStamp_ = 0;
+	thread_local uint32_t JunctionStorage::usedVisibility_ = JunctionStorage::ALL_USED_VISIBLE;
 	extern const std::string VERSION = "1.2.2";
 
 	bool compareById(const BlockInstance & a, const BlockInstance & b)
@@ -123,59 +143,34 @@ namespace Sibelia
 		return double(totalBlockLength) / totalSize;
 	}
 
-	template<class It>
-	std::string Join(It start, It end, const std::string & delimiter)
+	// Sorts the blocks by the id, the chromosome and the start, which is the
+	// order all the writers expect
+	void BlocksFinder::SortBlocks(BlockList & blockList) const
 	{
-		It last = --end;
-		std::stringstream ss;
-		for (; start != end; ++start)
-		{
-			ss << *start << delimiter;
-		}
-
-		ss << *last;
-		return ss.str();
+		RadixSort(blockList, [](const BlockInstance & b) { return uint64_t(b.GetStart()); }, threads_);
+		RadixSort(blockList, [](const BlockInstance & b) { return uint64_t(b.GetChrId()); }, threads_);
+		RadixSort(blockList, [](const BlockInstance & b) { return uint64_t(b.GetBlockId()); }, threads_);
 	}
 
-
-	void BlocksFinder::ListBlocksIndicesGFF(BlockList & blockList, const std::string & fileName)
+	void BlocksFinder::ListBlocksIndicesGFF(const BlockList & block, const std::string & fileName) const
 	{
 		std::ofstream out;
 		TryOpenFile(fileName, out);
-		BlockList block(blockList);
-		std::sort(block.begin(), block.end(), compareById);
-		const std::string header[] =
-		{
-			"##gff-version 2",
-			std::string("##source-version SibeliaZ ") + VERSION,
-			"##Type DNA"
-		};
-
-		out << Join(header, header + 3, "\n") << std::endl;
+		OutputBuffer buffer(&out);
+		buffer.Put("##gff-version 2\n##source-version SibeliaZ ").Put(VERSION).Put("\n##Type DNA\n");
 		for (BlockList::const_iterator it = block.begin(); it != block.end(); ++it)
 		{
-			size_t start = it->GetStart() + 1;
-			size_t end = it->GetEnd();
-			const std::string record[] =
-			{
-				storage_.GetChrDescription(it->GetChrId()), 
-				"SibeliaZ",
-				"LCB_copy",
-				IntToStr(start),
-				IntToStr(end),
-				".",
-				(it->GetDirection() ? "+" : "-"),
-				".",
-				"id=" + IntToStr(static_cast<size_t>(it->GetBlockId()))
-			};
-
-			out << Join(record, record + sizeof(record) / sizeof(record[0]), "\t") << std::endl;
+			buffer.Put(storage_.GetChrDescription(it->GetChrId())).Put("\tSibeliaZ\tLCB_copy\t");
+			buffer.PutInt(uint64_t(it->GetStart() + 1)).Put('\t').PutInt(uint64_t(it->GetEnd())).Put("\t.\t");
+			buffer.Put(it->GetDirection() ? '+' : '-').Put("\t.\tid=").PutInt(uint64_t(it->GetBlockId())).Put('\n');
 		}
+
+		buffer.Flush();
 	}
 
-	void BlocksFinder::TryOpenFile(const std::string & fileName, std::ofstream & stream) const
+	void BlocksFinder::TryOpenFile(const std::string & fileName, std::ofstream & stream, std::ios_base::openmode mode) const
 	{
-		stream.open(fileName.c_str());
+		stream.open(fileName.c_str(), mode);
 		if (!stream)
 		{
 			throw std::runtime_error(("Cannot open file " + fileName).c_str());
@@ -19,6 +19,13 @@
 #include <unordered_set>
 
 #include "path.h"
+#include "gfawriter.h"
+#include "blockaligner.h"
+#include "alignmentscheduler.h"
+#include "outputgenerator.h"
+#include "radixsort.h"
+#include "intervalset.h"
+#include "phasescheduler.h"
 
 namespace Sibelia
 {
@@ -30,7 +37,7 @@ namespace Sibelia
 	{
 	public:
 		BlockInstance() {}
-		BlockInstance(int id, const size_t chr, size_t start, size_t end) : id_(id), chr_(chr), start_(start), end_(end) {}
+		BlockInstance(int id, const size_t chr, size_t start, size_t end) : id_(id), chr_(static_cast<uint32_t>(chr)), start_(start), end_(end) {}
 		void Reverse();
 		int GetSignedBlockId() const;
 		bool GetDirection() const;
@@ -44,12 +51,14 @@ namespace Sibelia
 		bool operator == (const BlockInstance & toCompare) const;
 		bool operator != (const BlockInstance & toCompare) const;
 	private:
-		int id_;
-		size_t start_;
-		size_t end_;
-		size_t chr_;
+		int32_t id_;
+		uint32_t chr_;
+		uint64_t start_;
+		uint64_t end_;
 	};
 
+	static_assert(sizeof(BlockInstance) <= 24, "BlockInstance is copied and sorted for every block copy");
+
 	namespace
 	{
 		const bool COVERED = true;
@@ -61,13 +70,6 @@ namespace Sibelia
 			return a.first < b.first;
 		}
 
-		std::string IntToStr(size_t x)
-		{
-			std::stringstream ss;
-			ss << x;
-			return ss.str();
-		}
-
 		template<class Iterator1, class Iterator2>
 		void CopyN(Iterator1 it, size_t count, Iterator2 out)
 		{
@@ -109,6 +111,17 @@ namespace Sibelia
 			}
 		}
 
+		// Splits a list sorted by the block id into the ranges of copies of each block
+		void GroupSortedById(const std::vector<BlockInstance> & store, std::vector<IndexPair> & group)
+		{
+			for (size_t now = 0; now < store.size();)
+			{
+				size_t prev = now;
+				for (; now < store.size() && store[now].GetBlockId() == store[prev].GetBlockId(); now++);
+				group.push_back(std::make_pair(prev, now));
+			}
+		}
+
 		template<class F>
 		bool CompareBlocks(const BlockInstance & a, const BlockInstance & b, F f)
 		{
@@ -121,52 +134,6 @@ namespace Sibelia
 			return f(a) == f(b);
 		}
 
-		template<class Iterator, class F, class ReturnType>
-		struct FancyIterator : public std::iterator<std::forward_iterator_tag, ReturnType>
-		{
-		public:
-			FancyIterator & operator++()
-			{
-				++it;
-				return *this;
-			}
-
-			FancyIterator operator++(int)
-			{
-				FancyIterator ret(*this);
-				++(*this);
-				return ret;
-			}
-
-			bool operator == (FancyIterator toCompare) const
-			{
-				return it == toCompare.it;
-			}
-
-			bool operator != (FancyIterator toCompare) const
-			{
-				return !(*this == toCompare);
-			}
-
-			ReturnType operator * ()
-			{
-				return f(*it);
-			}
-
-			FancyIterator() {}
-			FancyIterator(Iterator it, F f) : it(it), f(f) {}
-
-		private:
-			F f;
-			Iterator it;
-		};
-
-		template<class Iterator, class F, class ReturnType>
-		FancyIterator<Iterator, F, ReturnType> CFancyIterator(Iterator it, F f, ReturnType)
-		{
-			return FancyIterator<Iterator, F, ReturnType>(it, f);
-		}
-
 	}
 
 	bool compareById(const BlockInstance & a, const BlockInstance & b);
@@ -175,23 +142,49 @@ namespace Sibelia
 
 	void CreateOutDirectory(const std::string & path);
 
+	// Bytes of the process in RAM, 0 where it cannot be read
+	size_t ResidentMemory();
+
 	class BlocksFinder
 	{
 	public:
 
+		// Vertex ids, chromosomes and positions are 32-bit in the storage. The
+		// rank is a hash that wraps around, so it keeps the full width
 		struct Bundle
 		{
-			int64_t vid;
+			typedef std::pair<uint32_t, uint32_t> Locus;
+
+			uint64_t rank;
+			int32_t vid;
+			uint32_t count;
+			Locus resolve;
+			Locus locus;
 			char ch;
-			size_t count;
-			size_t rank = 0;
-			std::pair<size_t, size_t> resolve;
 
-			Bundle(int64_t vid, char ch, size_t count, size_t rank = 0, std::pair<size_t, size_t> resolve = std::make_pair(SIZE_MAX, SIZE_MAX)) :
-				vid(vid), ch(ch), count(count), rank(rank), resolve(resolve)
+			Bundle(int64_t vid, char ch, size_t count, size_t rank = 0, Locus resolve = Locus(UINT32_MAX, UINT32_MAX)) :
+				rank(rank), vid(static_cast<int32_t>(vid)), count(static_cast<uint32_t>(count)), resolve(resolve), locus(UINT32_MAX, UINT32_MAX), ch(ch)
 			{
 			}
 
+			// Same multiplicity order, but bundles of equal multiplicity are
+			// placed by the leftmost (chr, position) of their occurrences, so
+			// the seeds of a phase touch nearby parts of the genomes
+			static bool LocalityCompare(const Bundle & a, const Bundle & b)
+			{
+				if (a.count != b.count)
+				{
+					return a.count > b.count;
+				}
+
+				if (a.locus != b.locus)
+				{
+					return a.locus < b.locus;
+				}
+
+				return a < b;
+			}
+
 			bool operator < (const Bundle & a) const
 			{
 				if (count != a.count)
@@ -208,8 +201,17 @@ namespace Sibelia
 			}
 		};
 
+		static_assert(sizeof(Bundle) <= 40, "Bundles are sorted as a whole and must stay compact");
+
 		typedef std::vector<Path::Instance> InstanceVector;
 
+		// Per-thread scratch of the vote for the next vertex: the counters and
+		// the walks of the instances if they are collected by parallel tasks
+		struct VertexCount : public EpochHashMap<uint32_t>
+		{
+			std::vector<std::vector<int64_t> > walk;
+		};
+
 		BlocksFinder(JunctionStorage & storage, size_t k) : storage_(storage), k_(k)
 		{
 			progressCount_ = 50;
@@ -225,12 +227,18 @@ namespace Sibelia
 			{
 			}
 
-			void Process(Bundle bundle, Path & currentPath, std::vector<size_t> & data, std::vector<uint32_t> & count, InstanceVector & bestInstance, std::vector<int64_t> & logPath, int64_t & bestScore)
+			size_t Process(Bundle bundle, Path & currentPath, VertexCount & count, InstanceVector & bestInstance, std::vector<int64_t> & logPath, int64_t & bestScore)
 			{
 				int64_t score;
+				size_t steps = 0;
 				logPath.clear();
 				bestInstance.clear();
 				int64_t vid = bundle.vid;
+				if (!finder.HasUnusedOccurrence(bundle))
+				{
+					finder.skipped_++;
+					return 0;
+				}
 
 				char initChar = bundle.ch;
 #ifdef _DEBUG_OUT_
@@ -257,7 +265,7 @@ namespace Sibelia
 						bool ret = true;
 						bool positive = false;
 						int64_t prevLength = currentPath.MiddlePathLength();
-						while ((ret = finder.ExtendPathForward(currentPath, count, data, bestRightSize, bestScore, score, bestInstance)) && currentPath.MiddlePathLength() - prevLength <= minRun)
+						while ((ret = finder.ExtendPath<true>(currentPath, count, bestRightSize, bestScore, score)) && currentPath.MiddlePathLength() - prevLength <= minRun)
 						{
 							positive = positive || (score > 0);
 						}
@@ -268,21 +276,16 @@ namespace Sibelia
 						}
 					}
 
-					std::vector<Edge> bestEdge;
+					// The best states are not copied while extending, the path is
+					// rolled back to the best one once the direction is finished
+					steps += currentPath.RightSize();
+					currentPath.RollBack(bestRightSize, 1);
+					if (bestScore > 0)
 					{
-						for (size_t i = 0; i < bestRightSize - 1; i++)
-						{
-							bestEdge.push_back(currentPath.RightPoint(i).GetEdge());
-						}
-
-						currentPath.Clear();
-						currentPath.Init(vid, initChar);
-						for (auto & e : bestEdge)
-						{
-							currentPath.PointPushBack(e);
-						}
+						CopyGoodInstances(currentPath, bestInstance);
 					}
-					
+
+					int64_t forwardScore = bestScore;
 #ifdef _DEBUG_OUT_
 					if (finder.debug_)
 					{
@@ -294,7 +297,7 @@ namespace Sibelia
 						bool ret = true;
 						bool positive = false;
 						int64_t prevLength = currentPath.MiddlePathLength();
-						while ((ret = finder.ExtendPathBackward(currentPath, count, data, bestLeftSize, bestScore, score, bestInstance)) && currentPath.MiddlePathLength() - prevLength <= minRun);
+						while ((ret = finder.ExtendPath<false>(currentPath, count, bestLeftSize, bestScore, score)) && currentPath.MiddlePathLength() - prevLength <= minRun);
 						{
 							positive = positive || (score > 0);
 						}
@@ -305,8 +308,26 @@ namespace Sibelia
 						}
 					}
 
+					steps += currentPath.LeftSize();
+					if (bestScore > forwardScore)
+					{
+						currentPath.RollBack(bestRightSize, bestLeftSize);
+						CopyGoodInstances(currentPath, bestInstance);
+					}
+
 					currentPath.Clear();
 				}
+
+				return steps * bundle.count;
+			}
+
+			static void CopyGoodInstances(const Path & currentPath, InstanceVector & instance)
+			{
+				instance.clear();
+				for (auto it : currentPath.GoodInstancesList())
+				{
+					instance.push_back(*it);
+				}
 			}
 
 			void Finalize(const InstanceVector & instance)
@@ -331,17 +352,79 @@ namespace Sibelia
 				}
 			}
 
+			void Validate(size_t phase, size_t phaseLimit, size_t phaseNumber, Path & currentPath, VertexCount & count, std::vector<int64_t> & logPath, int64_t & bestScore)
+			{
+				size_t phaseFailure = finder.failure_;
+				auto & result = finder.result_[phaseNumber % 2];
+				JunctionStorage::SetUsedStamp(uint32_t(phaseNumber + 1));
+				JunctionStorage::SetUsedVisibility(JunctionStorage::ALL_USED_VISIBLE);
+				for (size_t idx = phase; idx < phaseLimit; idx++)
+				{
+					auto & instance = result[idx - phase];
+					if (instance.size() > 1)
+					{
+						bool isGood = true;
+						for (auto inst : instance)
+						{
+							if (finder.invalidChr_.count(inst.Front().GetChrId()) == 0 && finder.prevInvalidChr_.count(inst.Front().GetChrId()) == 0)
+							{
+								continue;
+							}
+
+							if (inst.Front().IsUsedUntil(inst.Back()))
+							{
+								isGood = false;
+								break;
+							}
+						}
+
+						if (isGood)
+						{
+							Finalize(instance);
+						}
+						else
+						{
+							finder.failure_++;
+							Process(finder.bundle_[idx], currentPath, count, instance, logPath, bestScore);
+							if (instance.size() > 1)
+							{
+								Finalize(instance);
+							}
+						}
+					}
+				}
+
+				// A pipelined phase was explored before the previous one was finalized,
+				// so its results must be checked against the blocks of both
+				finder.prevInvalidChr_.clear();
+				if (finder.pipelined_)
+				{
+					finder.prevInvalidChr_.swap(finder.invalidChr_);
+				}
+
+				finder.invalidChr_.clear();
+				finder.scheduler_->Record(phase, phaseLimit - phase, finder.failure_ - phaseFailure, finder.pendingCost_);
+			}
+
 			void operator()()
 			{
 				int64_t bestScore;
 				std::vector<int64_t> logPath;
 
 				size_t bundleIdx;
-				std::vector<size_t> data;
-				std::vector<uint32_t> count(finder.storage_.GetVerticesNumber() * 2 + 1, 0);
-				Path currentPath(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_, true);
+				double wait = 0;
+				VertexCount count;
+				Path currentPath(finder.storage_, finder.maxBranchSize_, finder.minBlockSize_, finder.minBlockSize_, finder.maxFlankingSize_, true, finder.parallelThreshold_);
 				for (; finder.go_; )
 				{
+					if (finder.pipelined_ && omp_get_thread_num() == 0 && finder.pendingPhase_ < finder.pendingPhaseLimit_)
+					{
+						Validate(finder.pendingPhase_, finder.pendingPhaseLimit_, finder.phaseNumber_ - 1, currentPath, count, logPath, bestScore);
+					}
+
+					// Explorers of a pipelined phase do not see the blocks of the phase being validated
+					auto & result = finder.result_[finder.phaseNumber_ % 2];
+					JunctionStorage::SetUsedVisibility(finder.pipelined_ ? uint32_t(finder.phaseNumber_) : JunctionStorage::ALL_USED_VISIBLE);
 					for (bool inPhase = true; inPhase; )
 					{
 						#pragma omp critical
@@ -358,7 +441,7 @@ namespace Sibelia
 
 						if (inPhase)
 						{
-							Process(finder.bundle_[bundleIdx], currentPath, data, count, finder.result_[bundleIdx - finder.currentPhase_], logPath, bestScore);
+							finder.phaseCost_ += Process(finder.bundle_[bundleIdx], currentPath, count, result[bundleIdx - finder.currentPhase_], logPath, bestScore);
 							if (finder.count_++ % finder.progressPortion_ == 0)
 							{
 								std::cout << '.' << std::flush;
@@ -366,59 +449,29 @@ namespace Sibelia
 						}
 					}
 
+					double arrival = omp_get_wtime();
 					#pragma omp barrier
+					wait += omp_get_wtime() - arrival;
 					if (omp_get_thread_num() == 0)
 					{
-						for (size_t idx = finder.currentPhase_; idx < finder.currentPhaseLimit_; idx++)
+						finder.pendingCost_ = finder.phaseCost_;
+						finder.phaseCost_ = 0;
+						finder.pendingPhase_ = finder.currentPhase_;
+						finder.pendingPhaseLimit_ = finder.currentPhaseLimit_;
+						bool last = finder.currentPhaseLimit_ >= finder.bundle_.size();
+						if (!finder.pipelined_ || last)
 						{
-							auto & instance = finder.result_[idx - finder.currentPhase_];
-							if (instance.size() > 1)
-							{
-								bool isGood = true;
-								for (auto inst : instance)
-								{
-									if (finder.invalidChr_.count(inst.Front().GetChrId()) == 0)
-									{
-										continue;
-									}
-
-									for (auto it = inst.Front(); it != inst.Back(); ++it)
-									{
-										if (it.IsUsed())
-										{
-											isGood = false;
-											break;
-										}
-									}
-
-									if (!isGood)
-									{
-										break;
-									}
-								}
-
-								if (isGood)
-								{
-									Finalize(instance);
-								}
-								else
-								{
-									finder.failure_++;
-									Process(finder.bundle_[idx], currentPath, data, count, instance, logPath, bestScore);
-									if (instance.size() > 1)
-									{
-										Finalize(instance);
-									}
-								}
-							}
+							Validate(finder.currentPhase_, finder.currentPhaseLimit_, finder.phaseNumber_, currentPath, count, logPath, bestScore);
 						}
 
-						finder.invalidChr_.clear();
-						if (finder.currentPhaseLimit_ < finder.bundle_.size())
+						// The explorers of the next phase see the blocks validated so far
+						JunctionStorage::PublishUsed();
+						if (!last)
 						{
+							finder.phaseNumber_++;
 							finder.currentPhase_ = finder.currentPhaseLimit_;
 							finder.currentBundleExplore_ = finder.currentPhaseLimit_;
-							size_t nextPhase = finder.currentPhaseLimit_ + finder.phaseSize_;
+							size_t nextPhase = finder.currentPhaseLimit_ + finder.scheduler_->NextPhaseSize();
 							finder.currentPhaseLimit_ = finder.bundle_.size() < nextPhase ? finder.bundle_.size() : nextPhase;
 						}
 						else
@@ -427,9 +480,14 @@ namespace Sibelia
 						}
 					}
 
+					arrival = omp_get_wtime();
 					#pragma omp barrier
+					wait += omp_get_wtime() - arrival;
 				}
 
+				#pragma omp atomic
+				finder.barrierWait_ += wait;
+
 			}
 			
 		};
@@ -450,14 +508,17 @@ namespace Sibelia
 			}
 		}
 
-		void FindBlocks(int64_t minBlockSize, int64_t maxBranchSize, int64_t maxFlankingSize, int64_t lookingDepth, int64_t sampleSize, int64_t threads, const std::string & debugOut)
+		void FindBlocks(int64_t minBlockSize, int64_t maxBranchSize, int64_t maxFlankingSize, int64_t lookingDepth, int64_t sampleSize, int64_t threads, const std::string & debugOut, bool adaptivePhases = false, bool pipelined = false, bool localityOrder = false, size_t parallelThreshold = 0)
 		{
 			failure_ = 0;
+			skipped_ = 0;
+			barrierWait_ = 0;
 			threads_ = threads;
 			lookingDepth_ = lookingDepth;
 			minBlockSize_ = minBlockSize;
 			maxBranchSize_ = maxBranchSize;
 			maxFlankingSize_ = maxFlankingSize;
+			parallelThreshold_ = parallelThreshold;
 			for (int64_t v = -storage_.GetVerticesNumber() + 1; v < storage_.GetVerticesNumber(); v++)
 			{
 				std::set<char> good;
@@ -485,10 +546,15 @@ namespace Sibelia
 							{
 								bundle.rank += it.GetChrId() * base;
 								base *= 31;
+								Bundle::Locus locus(static_cast<uint32_t>(it.GetChrId()), static_cast<uint32_t>(it.GetPosition()));
+								if (locus < bundle.locus)
+								{
+									bundle.locus = locus;
+								}
 
 								if (it.IsPositiveStrand())
 								{
-									std::pair<size_t, size_t> resolve(it.GetPosition(), it.GetChrId());
+									Bundle::Locus resolve(static_cast<uint32_t>(it.GetPosition()), static_cast<uint32_t>(it.GetChrId()));
 									if (resolve < bundle.resolve)
 									{
 										bundle.resolve = resolve;
@@ -514,11 +580,25 @@ namespace Sibelia
 
 			go_ = true;
 			clock_t mark = clock();
-			std::sort(bundle_.begin(), bundle_.end());
+			if (localityOrder)
+			{
+				std::sort(bundle_.begin(), bundle_.end(), Bundle::LocalityCompare);
+			}
+			else
+			{
+				std::sort(bundle_.begin(), bundle_.end());
+			}
+
 			currentPhase_ = 0;
-			phaseSize_ = 256;
-			currentPhaseLimit_ = bundle_.size() < phaseSize_ ? bundle_.size() : phaseSize_;
-			result_.resize(phaseSize_);
+			phaseNumber_ = 0;
+			phaseCost_ = 0;
+			pendingPhase_ = pendingPhaseLimit_ = 0;
+			pipelined_ = pipelined;
+			scheduler_.reset(new PhaseScheduler(threads, adaptivePhases));
+			size_t phaseSize = scheduler_->FirstPhaseSize();
+			currentPhaseLimit_ = bundle_.size() < phaseSize ? bundle_.size() : phaseSize;
+			result_[0].resize(scheduler_->MaxPhaseSize());
+			result_[1].resize(scheduler_->MaxPhaseSize());
 			currentBundleExplore_ = 0;
 			#pragma omp parallel num_threads(threads)
 			{
@@ -527,42 +607,195 @@ namespace Sibelia
 			}
 
 			std::cout << ']' << std::endl;
+			std::cout << "Phases: " << scheduler_->Stats().size() << ", conflicts: " << failure_ << ", skipped seeds: " << skipped_ << std::endl;
+			std::cout << "Time waited at the phase barriers, summed over the threads: " << barrierWait_ << " s" << std::endl;
+		}
+
+		const std::vector<PhaseScheduler::PhaseStats> & GetPhaseStats() const
+		{
+			return scheduler_->Stats();
 		}
 
 
-		void ListBlocksSequences(const BlockList & block, const std::string & directory) const
+		void ListBlocksSequences(const BlockList & blockList, const std::string & directory) const
 		{
 			std::vector<IndexPair> group;
-			BlockList blockList = block;
-			GroupBy(blockList, compareById, std::back_inserter(group));
+			GroupSortedById(blockList, group);
 			for (std::vector<IndexPair>::iterator it = group.begin(); it != group.end(); ++it)
 			{
 				std::ofstream out;
 				std::stringstream ss;
 				ss << directory << "/" << blockList[it->first].GetBlockId() << ".fa";
 				TryOpenFile(ss.str(), out);
-				for (size_t block = it->first; block < it->second; block++)
+				OutputBuffer buffer(&out);
+				WriteBlockSequences(blockList, *it, buffer);
+				buffer.Flush();
+			}
+		}
+
+		// Writes the sequences of all blocks into a single FASTA file, and the
+		// block id with the offset and the length of its records in bytes into
+		// the index next to it. Batches of blocks are formatted in parallel and
+		// written in the order of the ids
+		void ListBlocksArchive(const BlockList & blockList, const std::string & fileName) const
+		{
+			std::vector<IndexPair> group;
+			GroupSortedById(blockList, group);
+			std::ofstream out;
+			std::ofstream index;
+			TryOpenFile(fileName, out, std::ios_base::out | std::ios_base::binary);
+			TryOpenFile(fileName + ".idx", index);
+			size_t offset = 0;
+			size_t batchSize = std::max(threads_, size_t(1)) * ARCHIVE_BATCH;
+			std::vector<OutputBuffer> text(batchSize);
+			OutputBuffer outBuffer(&out);
+			OutputBuffer indexBuffer(&index);
+			for (size_t batch = 0; batch < group.size(); batch += batchSize)
+			{
+				size_t batchEnd = std::min(group.size(), batch + batchSize);
+				#pragma omp parallel for schedule(dynamic) num_threads(threads_)
+				for (int64_t i = batch; i < int64_t(batchEnd); i++)
+				{
+					text[i - batch].Data().clear();
+					WriteBlockSequences(blockList, group[i], text[i - batch]);
+				}
+
+				for (size_t i = batch; i < batchEnd; i++)
 				{
-					size_t length = blockList[block].GetLength();
-					size_t chr = blockList[block].GetChrId();
-					size_t chrSize = storage_.GetChrSequence(chr).size();
-					out << ">" << blockList[block].GetBlockId() << "_" << block - it->first << " ";
-					out << storage_.GetChrDescription(chr) << ";";
-					if (blockList[block].GetSignedBlockId() > 0)
+					const std::string & now = text[i - batch].Data();
+					outBuffer.Put(now);
+					indexBuffer.PutInt(uint64_t(blockList[group[i].first].GetBlockId())).Put('\t').PutInt(uint64_t(offset)).Put('\t').PutInt(uint64_t(now.size())).Put('\n');
+					offset += now.size();
+				}
+			}
+
+			outBuffer.Flush();
+			indexBuffer.Flush();
+		}
+
+		// Aligns the copies of every block and writes the alignment into
+		// alignment.maf in the order of the block ids. The blocks are aligned
+		// in parallel, each thread with its own aligner, over a window of
+		// blocks sliding as their alignments are written, scheduled largest
+		// first within the memory budget in bytes (0 is unlimited). The budget
+		// is the memory that was available before the graph was loaded, so the
+		// memory the process takes by now is subtracted from it. A block that
+		// failed next to others is retried alone before it is given up. The
+		// number of threads is separate from the one finding the blocks. In the
+		// anchored mode only the windows between the junctions shared by all
+		// copies are aligned. Sequences of the blocks that could not be
+		// aligned are written into the blocks directory, as the sibeliaz
+		// script does
+		void AlignBlocks(const BlockList & blockList, const std::string & outDir, const std::string & mafCmd, size_t alignMemory, size_t alignThreads, bool anchored) const
+		{
+			if (!BlockAligner::Available())
+			{
+				throw std::runtime_error("sibeliaz-lcb was built without spoa, cannot align the blocks");
+			}
+
+			std::vector<IndexPair> group;
+			GroupSortedById(blockList, group);
+			std::ofstream out;
+			TryOpenFile(outDir + "/alignment.maf", out);
+			{
+				OutputBuffer header(&out);
+				header.Put("##maf version=1\n# sibeliaz v").Put(VERSION).Put(" \n# cmd=").Put(mafCmd).Put('\n');
+			}
+
+			if (alignMemory > 0)
+			{
+				alignMemory -= std::min(alignMemory - 1, ResidentMemory());
+			}
+
+			std::vector<size_t> failed;
+			size_t window = std::max(alignThreads, size_t(1)) * ALIGN_WINDOW;
+			std::vector<std::vector<size_t> > anchor(window);
+			OrderedOutput maf(out, window);
+			AlignmentScheduler scheduler(group.size(), window, alignMemory);
+			#pragma omp parallel num_threads(alignThreads)
+			{
+				size_t task;
+				BlockAligner aligner;
+				OutputBuffer text;
+				AlignmentScheduler::Action action;
+				while ((action = scheduler.Next(task)) != AlignmentScheduler::FINISH)
+				{
+					std::vector<size_t> & now = anchor[task % window];
+					if (action == AlignmentScheduler::ESTIMATE)
 					{
-						out << blockList[block].GetStart() << ";" << length << ";" << "+;" << chrSize << std::endl;
-						OutputLines(storage_.GetChrSequence(chr).begin() + blockList[block].GetStart(), length, out);
+						std::vector<size_t> length;
+						for (size_t block = group[task].first; block < group[task].second; block++)
+						{
+							length.push_back(blockList[block].GetLength());
+						}
+
+						now.clear();
+						if (anchored)
+						{
+							FindAnchors(blockList, group[task], now);
+							scheduler.Estimated(task, BlockAligner::AnchoredMemoryEstimate(length, now, k_));
+						}
+						else
+						{
+							size_t totalLength = std::accumulate(length.begin(), length.end(), size_t(0));
+							scheduler.Estimated(task, BlockAligner::MemoryEstimate(length.size(), totalLength, *std::max_element(length.begin(), length.end())));
+						}
 					}
 					else
 					{
-						size_t start = chrSize - blockList[block].GetEnd();
-						out << start << ";" << length << ";" << "-;" << chrSize << std::endl;
-						std::string::const_reverse_iterator it(storage_.GetChrSequence(chr).begin() + blockList[block].GetEnd());
-						OutputLines(CFancyIterator(it, TwoPaCo::DnaChar::ReverseChar, ' '), length, out);
+						bool aligned = AlignBlock(blockList, group[task], anchored, now, aligner, text);
+						if (!aligned && scheduler.Retry(task))
+						{
+							continue;
+						}
+
+						if (!aligned)
+						{
+							#pragma omp critical(failedBlocks)
+							failed.push_back(task);
+						}
+
+						std::vector<size_t>().swap(now);
+						scheduler.Done(task, maf.Submit(task, text.Data()));
 					}
+				}
+			}
 
-					out << std::endl;
+			if (!out.flush())
+			{
+				throw std::runtime_error("Cannot write the output");
+			}
+
+			std::sort(failed.begin(), failed.end());
+			for (size_t i : failed)
+			{
+				if (i == failed[0])
+				{
+					CreateOutDirectory(outDir + "/blocks");
 				}
+
+				std::ofstream fasta;
+				std::stringstream ss;
+				ss << outDir << "/blocks/" << blockList[group[i].first].GetBlockId() << ".fa";
+				TryOpenFile(ss.str(), fasta);
+				OutputBuffer buffer(&fasta);
+				WriteBlockSequences(blockList, group[i], buffer);
+				buffer.Flush();
+			}
+
+			if (scheduler.Deferred() > 0)
+			{
+				std::cout << "Blocks aligned alone over the memory budget: " << scheduler.Deferred() << std::endl;
+			}
+
+			if (scheduler.Retried() > 0)
+			{
+				std::cout << "Blocks retried alone after failing to align: " << scheduler.Retried() << std::endl;
+			}
+
+			if (failed.size() > 0)
+			{
+				std::cout << "Blocks failed to align: " << failed.size() << std::endl;
 			}
 		}
 
@@ -587,17 +820,11 @@ namespace Sibelia
 			const std::vector<int> & multiplicity;
 		};
 
-		void GenerateOutput(const std::string & outDir, bool genSeq)
+		void GenerateOutput(const std::string & outDir, bool genSeq, bool archive = false, bool align = false, const std::string & mafCmd = "", size_t alignMemory = 0, size_t alignThreads = 1, bool anchored = false, bool gfa = false)
 		{
-			std::vector<std::vector<bool> > covered(storage_.GetChrNumber());
-			for (size_t i = 0; i < covered.size(); i++)
-			{
-				covered[i].assign(storage_.GetChrSequence(i).size() + 1, false);
-			}
-
 			int64_t trimmedId = 1;
 			std::vector<IndexPair> group;
-			std::vector<BlockInstance> buffer;
+			std::vector<BlockList> trimmed;
 			std::vector<BlockInstance> trimmedBlocks;
 			std::vector<int> copiesCount_(blocksFound_ + 1, 0);
 			for (auto b : blocksInstance_)
@@ -606,37 +833,17 @@ namespace Sibelia
 			}
 
 			GroupBy(blocksInstance_, SortByMultiplicity(copiesCount_), std::back_inserter(group));
-			for (auto g : group)
+			TrimGroups(group, trimmed);
+			for (size_t g = 0; g < group.size(); g++)
 			{
-				buffer.clear();
-				for (size_t i = g.first; i < g.second; i++)
+				if (trimmed[g].size() > 1)
 				{
-					size_t chr = blocksInstance_[i].GetChrId();
-					size_t start = blocksInstance_[i].GetStart();
-					size_t end = blocksInstance_[i].GetEnd();
-					for (; covered[chr][start] && start < end; start++);
-					for (; covered[chr][end] && end > start; end--);
-					if (end - start >= minBlockSize_)
+					for (const auto & it : trimmed[g])
 					{
-						buffer.push_back(BlockInstance(blocksInstance_[i].GetSign() * trimmedId, chr, start, end));
-						std::fill(covered[chr].begin() + start, covered[chr].begin() + end, true);
+						trimmedBlocks.push_back(BlockInstance(it.GetSign() * trimmedId, it.GetChrId(), it.GetStart(), it.GetEnd()));
 					}
-				}
 
-				if (buffer.size() > 1)
-				{
 					trimmedId++;
-					for (const auto & it : buffer)
-					{
-						trimmedBlocks.push_back(it);
-					}
-				}
-				else
-				{
-					for (const auto & it : buffer)
-					{
-						std::fill(covered[it.GetChrId()].begin() + it.GetStart(), covered[it.GetChrId()].begin() + it.GetEnd(), false);
-					}
 				}
 			}
 
@@ -644,11 +851,23 @@ namespace Sibelia
 			std::cout.precision(2);
 			std::cout << "Blocks found: " << trimmedId - 1 << std::endl;
 			std::cout << "Coverage: " << CalculateCoverage(trimmedBlocks) << std::endl;
-			std::sort(trimmedBlocks.begin(), trimmedBlocks.end());
+			SortBlocks(trimmedBlocks);
 			CreateOutDirectory(outDir);
 			std::string blocksDir = outDir + "/blocks";
 			ListBlocksIndicesGFF(trimmedBlocks, outDir + "/" + "blocks_coords.gff");
-			if (genSeq)
+			if (align)
+			{
+				AlignBlocks(trimmedBlocks, outDir, mafCmd, alignMemory, alignThreads, anchored);
+				if (gfa)
+				{
+					GfaWriter(storage_).Write(outDir + "/alignment.maf", outDir + "/alignment.gfa");
+				}
+			}
+			else if (genSeq && archive)
+			{
+				ListBlocksArchive(trimmedBlocks, outDir + "/blocks.fa");
+			}
+			else if (genSeq)
 			{
 				CreateOutDirectory(blocksDir);
 				ListBlocksSequences(trimmedBlocks, blocksDir);
@@ -658,189 +877,503 @@ namespace Sibelia
 
 	private:
 
-		template<class Iterator>
-		void OutputLines(Iterator start, size_t length, std::ostream & out) const
+		// Writes the sequence name, the start, the length, the strand and the
+		// size of the sequence of a copy, as in MAF records
+		void PutCopyCoordinates(const BlockInstance & block, char delimiter, OutputBuffer & out) const
+		{
+			size_t chr = block.GetChrId();
+			size_t chrSize = storage_.GetChrSequence(chr).size();
+			size_t start = block.GetSignedBlockId() > 0 ? block.GetStart() : chrSize - block.GetEnd();
+			out.Put(storage_.GetChrDescription(chr)).Put(delimiter).PutInt(uint64_t(start)).Put(delimiter).PutInt(uint64_t(block.GetLength())).Put(delimiter);
+			out.Put(block.GetSignedBlockId() > 0 ? '+' : '-').Put(delimiter).PutInt(uint64_t(chrSize));
+		}
+
+		void WriteBlockSequences(const BlockList & blockList, IndexPair group, OutputBuffer & out) const
 		{
-			for (size_t i = 1; i <= length; i++, ++start)
+			for (size_t block = group.first; block < group.second; block++)
 			{
-				out << *start;
-				if (i % 80 == 0 && i != length)
+				size_t length = blockList[block].GetLength();
+				const std::string & sequence = storage_.GetChrSequence(blockList[block].GetChrId());
+				out.Put('>').PutInt(uint64_t(blockList[block].GetBlockId())).Put('_').PutInt(uint64_t(block - group.first)).Put(' ');
+				PutCopyCoordinates(blockList[block], ';', out);
+				out.Put('\n');
+				if (blockList[block].GetSignedBlockId() > 0)
 				{
-					out << std::endl;
+					out.PutLines(sequence.data() + blockList[block].GetStart(), length);
 				}
+				else
+				{
+					out.PutReverseLines(sequence.data() + blockList[block].GetEnd(), length);
+				}
+
+				out.Put('\n');
 			}
 		}
 
-		double CalculateCoverage(const BlockList & block) const;
-		void ListBlocksIndicesGFF(BlockList & blockList, const std::string & fileName);
-		void TryOpenFile(const std::string & fileName, std::ofstream & stream) const;
-
-		struct NextVertex
+		// Finds the junctions that occur exactly once in every copy of the
+		// block, in the same order and without overlaps in all of them. Their
+		// starts in the copies, in the direction of the copies, are written
+		// into the anchor array: anchor[a * copies + c] for the anchor a in
+		// the copy c. The junctions are taken greedily in the order of the
+		// first copy
+		void FindAnchors(const BlockList & blockList, IndexPair group, std::vector<size_t> & anchor) const
 		{
-			int64_t diff;
-			int64_t count;
-			JunctionStorage::JunctionSequentialIterator origin;
-			NextVertex() : count(0)
+			const size_t NONE = SIZE_MAX;
+			size_t copies = group.second - group.first;
+			std::vector<std::pair<int64_t, size_t> > first;
+			std::unordered_map<int64_t, size_t> candidate;
+			std::vector<size_t> offset;
+			for (size_t c = 0; c < copies; c++)
 			{
+				const BlockInstance & block = blockList[group.first + c];
+				int64_t chr = block.GetChrId();
+				int64_t low = 0;
+				int64_t high = storage_.GetChrVerticesCount(chr);
+				while (low < high)
+				{
+					int64_t mid = (low + high) / 2;
+					if (storage_.GetIterator(chr, mid).GetAbsolutePosition() < int64_t(block.GetStart()))
+					{
+						low = mid + 1;
+					}
+					else
+					{
+						high = mid;
+					}
+				}
+
+				std::vector<std::pair<int64_t, size_t> > junction;
+				for (int64_t idx = low; idx < storage_.GetChrVerticesCount(chr); idx++)
+				{
+					auto it = storage_.GetIterator(chr, idx);
+					int64_t pos = it.GetAbsolutePosition();
+					if (pos + k_ > int64_t(block.GetEnd()))
+					{
+						break;
+					}
+
+					if (block.GetDirection())
+					{
+						junction.push_back(std::make_pair(it.GetVertexId(), size_t(pos - block.GetStart())));
+					}
+					else
+					{
+						junction.push_back(std::make_pair(-it.GetVertexId(), size_t(block.GetEnd() - pos - k_)));
+					}
+				}
+
+				if (!block.GetDirection())
+				{
+					std::reverse(junction.begin(), junction.end());
+				}
+
+				if (c == 0)
+				{
+					first = junction;
+					for (const auto & j : first)
+					{
+						auto ins = candidate.insert(std::make_pair(j.first, candidate.size()));
+						if (!ins.second)
+						{
+							ins.first->second = NONE;
+						}
+					}
+
+					offset.assign(candidate.size() * copies, NONE);
+				}
 
+				for (const auto & j : junction)
+				{
+					auto it = candidate.find(j.first);
+					if (it != candidate.end() && it->second != NONE)
+					{
+						size_t & now = offset[it->second * copies + c];
+						if (now != NONE)
+						{
+							it->second = NONE;
+						}
+						else
+						{
+							now = j.second;
+						}
+					}
+				}
 			}
 
-			NextVertex(int64_t diff, JunctionStorage::JunctionSequentialIterator origin) : origin(origin), diff(diff), count(1)
+			std::vector<size_t> prevEnd(copies, 0);
+			for (const auto & j : first)
 			{
+				size_t idx = candidate[j.first];
+				bool ok = idx != NONE;
+				for (size_t c = 0; c < copies && ok; c++)
+				{
+					ok = offset[idx * copies + c] != NONE && offset[idx * copies + c] >= prevEnd[c];
+				}
 
+				if (ok)
+				{
+					for (size_t c = 0; c < copies; c++)
+					{
+						anchor.push_back(offset[idx * copies + c]);
+						prevEnd[c] = offset[idx * copies + c] + k_;
+					}
+				}
 			}
-		};
+		}
 
-		std::pair<int64_t, NextVertex> MostPopularVertex(const Path & currentPath, bool forward, std::vector<uint32_t> & count, std::vector<size_t> & data, bool tryUsed = false)
+		bool AlignBlock(const BlockList & blockList, IndexPair group, bool anchored, const std::vector<size_t> & anchor, BlockAligner & aligner, OutputBuffer & out) const
 		{
-			NextVertex ret;
-			int64_t bestVid = 0;
-			int64_t startVid = forward ? currentPath.RightVertex() : currentPath.LeftVertex();
-			const auto & instList = currentPath.GoodInstancesList().size() >= 2 ? currentPath.GoodInstancesList() : currentPath.AllInstances();
-			for (auto & inst : instList)
+			std::vector<std::string> copy;
+			std::vector<std::string> row;
+			for (size_t block = group.first; block < group.second; block++)
 			{
-				int64_t nowVid = forward ? inst->Back().GetVertexId() : inst->Front().GetVertexId();
-				if (nowVid == startVid)
+				const std::string & sequence = storage_.GetChrSequence(blockList[block].GetChrId());
+				if (blockList[block].GetSignedBlockId() > 0)
 				{
-					int64_t weight = abs(inst->Front().GetPosition() - inst->Back().GetPosition()) + 1;
-					auto origin = forward ? inst->Back() : inst->Front();
-					auto it = forward ? origin.Next() : origin.Prev();
-					for (size_t d = 1; it.Valid() && (d < size_t(lookingDepth_) || abs(it.GetPosition() - origin.GetPosition()) <= maxBranchSize_); d++)
+					copy.push_back(sequence.substr(blockList[block].GetStart(), blockList[block].GetLength()));
+				}
+				else
+				{
+					copy.push_back(std::string(blockList[block].GetLength(), 'N'));
+					TwoPaCo::DnaChar::ReverseComplement(sequence.data() + blockList[block].GetStart(), blockList[block].GetLength(), &copy.back()[0]);
+				}
+			}
+
+			bool ok = anchored ? aligner.AlignAnchored(copy, anchor, k_, row) : aligner.Align(copy, row);
+			if (!ok || row.size() < copy.size())
+			{
+				return false;
+			}
+
+			out.Put("\na\n");
+			for (size_t block = group.first; block < group.second; block++)
+			{
+				out.Put("s ");
+				PutCopyCoordinates(blockList[block], ' ', out);
+				out.Put(' ').Put(row[block - group.first]).Put('\n');
+			}
+
+			return true;
+		}
+
+		// Trims the copies of the groups of blocks, in the given order, by the
+		// positions covered by the kept earlier groups and by the earlier copies
+		// of the same group. Only groups with at least two copies left are kept.
+		// A group only touches the positions from the start to the end of its
+		// copies, so each group is put one level above the earlier groups it
+		// overlaps. The groups of a level are trimmed in parallel against the
+		// coverage of the levels below, which gives the sequential result
+		void TrimGroups(const std::vector<IndexPair> & group, std::vector<BlockList> & trimmed) const
+		{
+			std::vector<size_t> level(group.size());
+			std::vector<std::vector<size_t> > levelGroup(LevelGroups(group, level));
+			for (size_t g = 0; g < group.size(); g++)
+			{
+				levelGroup[level[g]].push_back(g);
+			}
+
+			trimmed.assign(group.size(), BlockList());
+			std::vector<IntervalSet> covered(storage_.GetChrNumber());
+			for (const auto & now : levelGroup)
+			{
+				#pragma omp parallel for schedule(dynamic) num_threads(threads_) if(now.size() > 1)
+				for (int64_t i = 0; i < int64_t(now.size()); i++)
+				{
+					TrimGroup(group[now[i]], covered, trimmed[now[i]]);
+				}
+
+				for (size_t g : now)
+				{
+					for (const auto & it : trimmed[g])
 					{
-						int64_t vid = it.GetVertexId();
-						if (!currentPath.IsInPath(vid) && (!it.IsUsed() || tryUsed))
+						if (trimmed[g].size() > 1)
 						{
-							auto adjVid = vid + storage_.GetVerticesNumber();
-							if (count[adjVid] == 0)
-							{
-								data.push_back(adjVid);
-							}
-
-							count[adjVid] += static_cast<uint32_t>(weight);
-							auto diff = abs(it.GetAbsolutePosition() - origin.GetAbsolutePosition());
-							if (count[adjVid] > ret.count || (count[adjVid] == ret.count && origin < ret.origin))
-							{
-								ret.diff = diff;
-								ret.origin = origin;
-								ret.count = count[adjVid];
-								bestVid = vid;
-							}
+							covered[it.GetChrId()].Insert(it.GetStart(), it.GetEnd());
 						}
 						else
 						{
-							break;
+							covered[it.GetChrId()].Erase(it.GetStart(), it.GetEnd());
 						}
+					}
+				}
+			}
+		}
 
-						if (forward)
+		void TrimGroup(IndexPair group, const std::vector<IntervalSet> & covered, BlockList & trimmed) const
+		{
+			std::map<size_t, IntervalSet> local;
+			for (size_t i = group.first; i < group.second; i++)
+			{
+				size_t chr = blocksInstance_[i].GetChrId();
+				size_t start = blocksInstance_[i].GetStart();
+				size_t end = blocksInstance_[i].GetEnd();
+				const IntervalSet & own = local[chr];
+				while (start < end)
+				{
+					size_t next = std::max(covered[chr].CoveredUntil(start), own.CoveredUntil(start));
+					if (next == start)
+					{
+						break;
+					}
+
+					start = std::min(next, end);
+				}
+
+				while (end > start)
+				{
+					size_t next = std::min(covered[chr].CoveredFrom(end), own.CoveredFrom(end));
+					if (next > end)
+					{
+						break;
+					}
+
+					end = std::max(next, start + 1) - 1;
+				}
+
+				if (end - start >= minBlockSize_)
+				{
+					trimmed.push_back(BlockInstance(blocksInstance_[i].GetSign(), chr, start, end));
+					local[chr].Insert(start, end);
+				}
+			}
+		}
+
+		// Returns the number of levels. The ranges of the groups put so far are
+		// kept per chromosome as start -> (end, level), the end of a copy is
+		// included since trimming looks at it
+		size_t LevelGroups(const std::vector<IndexPair> & group, std::vector<size_t> & level) const
+		{
+			size_t levels = 0;
+			std::vector<std::map<size_t, std::pair<size_t, size_t> > > range(storage_.GetChrNumber());
+			for (size_t g = 0; g < group.size(); g++)
+			{
+				level[g] = 0;
+				for (size_t i = group[g].first; i < group[g].second; i++)
+				{
+					auto & now = range[blocksInstance_[i].GetChrId()];
+					auto it = now.upper_bound(blocksInstance_[i].GetStart());
+					if (it != now.begin() && std::prev(it)->second.first > blocksInstance_[i].GetStart())
+					{
+						--it;
+					}
+
+					for (; it != now.end() && it->first <= blocksInstance_[i].GetEnd(); ++it)
+					{
+						level[g] = std::max(level[g], it->second.second + 1);
+					}
+				}
+
+				for (size_t i = group[g].first; i < group[g].second; i++)
+				{
+					auto & now = range[blocksInstance_[i].GetChrId()];
+					size_t start = blocksInstance_[i].GetStart();
+					size_t end = blocksInstance_[i].GetEnd() + 1;
+					auto it = now.upper_bound(start);
+					if (it != now.begin() && std::prev(it)->second.first > start)
+					{
+						--it;
+						if (it->first < start)
 						{
-							++it;
+							auto left = *it;
+							it = now.erase(it);
+							now.emplace_hint(it, left.first, std::make_pair(start, left.second.second));
+							if (left.second.first > end)
+							{
+								now.emplace_hint(it, end, left.second);
+							}
 						}
-						else
+					}
+
+					while (it != now.end() && it->first < end)
+					{
+						auto right = *it;
+						it = now.erase(it);
+						if (right.second.first > end)
 						{
-							--it;
+							now.emplace_hint(it, end, right.second);
+							break;
 						}
 					}
+
+					now.emplace(start, std::make_pair(end, level[g]));
 				}
+
+				levels = std::max(levels, level[g] + 1);
 			}
 
+			return levels;
+		}
 
-			for (auto vid : data)
+		double CalculateCoverage(const BlockList & block) const;
+		void SortBlocks(BlockList & blockList) const;
+		void ListBlocksIndicesGFF(const BlockList & blockList, const std::string & fileName) const;
+		void TryOpenFile(const std::string & fileName, std::ofstream & stream, std::ios_base::openmode mode = std::ios_base::out) const;
+
+		// A seed whose occurrences are all covered by the found blocks can not
+		// start a path, see Path::Init. With a single free occurrence the path
+		// can still recruit new instances while extending, so it is explored
+		bool HasUnusedOccurrence(const Bundle & bundle) const
+		{
+			for (JunctionStorage::JunctionIterator it(bundle.vid); it.Valid(); ++it)
 			{
-				count[vid] = 0;
+				auto seqIt = it.SequentialIterator();
+				if (!seqIt.IsUsed() && bundle.ch == seqIt.GetChar())
+				{
+					return true;
+				}
 			}
 
-			data.clear();
-			return std::make_pair(bestVid, ret);
+			return false;
 		}
 
-		bool ExtendPathForward(Path & currentPath,
-			std::vector<uint32_t> & count,
-			std::vector<size_t> & data,
-			size_t & bestRightSize,
-			int64_t & bestScore,
-			int64_t & nowScore,
-			InstanceVector & bestInstance)
+		struct NextVertex
 		{
-			bool success = false;
-			int64_t origin = currentPath.Origin();
-			std::pair<int64_t, NextVertex> nextForwardVid;
-			nextForwardVid = MostPopularVertex(currentPath, true, count, data);
-			if (nextForwardVid.first == 0)
+			int64_t diff;
+			int64_t count;
+			JunctionStorage::JunctionSequentialIterator origin;
+			NextVertex() : count(0)
 			{
-				nextForwardVid = MostPopularVertex(currentPath, true, count, data, true);
+
 			}
 
-			if (nextForwardVid.first != 0)
+			NextVertex(int64_t diff, JunctionStorage::JunctionSequentialIterator origin) : origin(origin), diff(diff), count(1)
 			{
-				for (auto it = nextForwardVid.second.origin; it.GetVertexId() != nextForwardVid.first; ++it)
+
+			}
+		};
+
+		static_assert(sizeof(NextVertex) <= 24, "NextVertex is returned by every vote and must stay compact");
+
+		// Calls f(vid, step) for the vertices following the origin that an
+		// instance votes for
+		template<bool forward, bool tryUsed, class F>
+		void Walk(const Path & currentPath, const JunctionStorage::JunctionSequentialIterator & origin, F f) const
+		{
+			auto it = forward ? origin.Next() : origin.Prev();
+			auto used = it;
+			if (!tryUsed && it.Valid())
+			{
+				used = forward ? it.NextUsed() : it.PrevUsed();
+			}
+
+			for (size_t d = 1; it.Valid() && (d < size_t(lookingDepth_) || abs(it.GetPosition() - origin.GetPosition()) <= maxBranchSize_); d++, forward ? ++it : --it)
+			{
+				int64_t vid = it.GetVertexId();
+				if (currentPath.IsInPath(vid) || (!tryUsed && it == used))
 				{
-#ifdef _DEBUG_OUT_
-					if (debug_)
-					{
-						std::cerr << "Attempting to push back the vertex:" << it.GetVertexId() << std::endl;
-					}
+					break;
+				}
 
-					if (missingVertex_.count(it.GetVertexId()))
-					{
-						std::cerr << "Alert: " << it.GetVertexId() << ", origin: " << currentPath.Origin() << std::endl;
-					}
-#endif
-					success = currentPath.PointPushBack(it.OutgoingEdge());
-					if (success)
+				f(vid, d);
+			}
+		}
+
+		// Walks of many instances only read the path and the storage, so they
+		// are collected by parallel tasks. The votes are then counted in the
+		// order of the instances, as in the sequential case
+		template<bool forward, bool tryUsed>
+		void CollectWalks(const Path & currentPath, const std::vector<Path::Instance*> & instList, int64_t startVid, VertexCount & count) const
+		{
+			if (count.walk.size() < instList.size())
+			{
+				count.walk.resize(instList.size());
+			}
+
+			uint32_t visibility = JunctionStorage::GetUsedVisibility();
+			#pragma omp taskloop grainsize(PARALLEL_GRAIN) shared(currentPath, instList, count)
+			for (int64_t k = 0; k < int64_t(instList.size()); k++)
+			{
+				auto & walk = count.walk[k];
+				walk.clear();
+				if (instList[k]->End<forward>().GetVertexId() == startVid)
+				{
+					uint32_t prevVisibility = JunctionStorage::GetUsedVisibility();
+					JunctionStorage::SetUsedVisibility(visibility);
+					Walk<forward, tryUsed>(currentPath, instList[k]->End<forward>(), [&walk](int64_t vid, size_t) { walk.push_back(vid); });
+					JunctionStorage::SetUsedVisibility(prevVisibility);
+				}
+			}
+		}
+
+		// The direction and whether used positions may be stepped over are
+		// template parameters, so the voting loop is compiled without branches
+		// on them
+		template<bool forward, bool tryUsed>
+		std::pair<int64_t, NextVertex> MostPopularVertex(const Path & currentPath, VertexCount & count)
+		{
+			NextVertex ret;
+			count.Clear();
+			int64_t bestVid = 0;
+			int64_t startVid = forward ? currentPath.RightVertex() : currentPath.LeftVertex();
+			const auto & instList = currentPath.GoodInstancesList().size() >= 2 ? currentPath.GoodInstancesList() : currentPath.AllInstances();
+			bool parallel = parallelThreshold_ > 0 && instList.size() >= parallelThreshold_;
+			if (parallel)
+			{
+				CollectWalks<forward, tryUsed>(currentPath, instList, startVid, count);
+			}
+
+			for (size_t k = 0; k < instList.size(); k++)
+			{
+				auto inst = instList[k];
+				int64_t nowVid = inst->End<forward>().GetVertexId();
+				if (nowVid == startVid)
+				{
+					uint32_t weight = static_cast<uint32_t>(abs(inst->Front().GetPosition() - inst->Back().GetPosition()) + 1);
+					auto origin = inst->End<forward>();
+					auto vote = [&](int64_t vid, size_t d)
 					{
-						nowScore = currentPath.Score(scoreFullChains_);
-#ifdef _DEBUG_OUT_
-						if (debug_)
+						uint32_t & vidCount = count[vid];
+						vidCount += weight;
+						if (vidCount > ret.count || (vidCount == ret.count && origin < ret.origin))
 						{
-							std::cerr << "Success! New score:" << nowScore << std::endl;
-							currentPath.DumpPath(std::cerr);
-							currentPath.DumpInstances(std::cerr);
+							auto it = forward ? origin + d : origin - d;
+							ret.diff = abs(it.GetAbsolutePosition() - origin.GetAbsolutePosition());
+							ret.origin = origin;
+							ret.count = vidCount;
+							bestVid = vid;
 						}
-#endif												
-						if (nowScore > bestScore)
+					};
+
+					if (parallel)
+					{
+						for (size_t d = 0; d < count.walk[k].size(); d++)
 						{
-							bestScore = nowScore;
-							bestRightSize = currentPath.RightSize();
-							if (nowScore > 0)
-							{
-								bestInstance.clear();
-								for (auto it : currentPath.GoodInstancesList())
-								{
-									bestInstance.push_back(*it);
-								}
-							}
+							vote(count.walk[k][d], d + 1);
 						}
 					}
+					else
+					{
+						Walk<forward, tryUsed>(currentPath, origin, vote);
+					}
 				}
 			}
 
-			return success;
+			return std::make_pair(bestVid, ret);
 		}
 
-		bool ExtendPathBackward(Path & currentPath,
-			std::vector<uint32_t> & count,
-			std::vector<size_t> & data,
-			size_t & bestLeftSize,
+		template<bool forward>
+		bool ExtendPath(Path & currentPath,
+			VertexCount & count,
+			size_t & bestSize,
 			int64_t & bestScore,
-			int64_t & nowScore,
-			InstanceVector & bestInstance)
+			int64_t & nowScore)
 		{
 			bool success = false;
-			std::pair<int64_t, NextVertex> nextBackwardVid;
-			nextBackwardVid = MostPopularVertex(currentPath, false, count, data);
-			if (nextBackwardVid.first == 0)
+			std::pair<int64_t, NextVertex> nextVid = MostPopularVertex<forward, false>(currentPath, count);
+			if (forward && nextVid.first == 0)
 			{
-//				nextBackwardVid = MostPopularVertex(currentPath, true, count, data, true);
+				// Used positions are stepped over only when going forward
+				nextVid = MostPopularVertex<forward, true>(currentPath, count);
 			}
 
-			if (nextBackwardVid.first != 0)
+			if (nextVid.first != 0)
 			{
-				for (auto it = nextBackwardVid.second.origin; it.GetVertexId() != nextBackwardVid.first; --it)
+				for (auto it = nextVid.second.origin; it.GetVertexId() != nextVid.first; forward ? ++it : --it)
 				{
 #ifdef _DEBUG_OUT_
 					if (debug_)
 					{
-						std::cerr << "Attempting to push front the vertex:" << it.GetVertexId() << std::endl;
+						std::cerr << "Attempting to push " << (forward ? "back" : "front") << " the vertex:" << it.GetVertexId() << std::endl;
 					}
 
 					if (missingVertex_.count(it.GetVertexId()))
@@ -848,7 +1381,7 @@ namespace Sibelia
 						std::cerr << "Alert: " << it.GetVertexId() << ", origin: " << currentPath.Origin() << std::endl;
 					}
 #endif
-					success = currentPath.PointPushFront(it.IngoingEdge());
+					success = currentPath.PointPush<forward>(forward ? it.OutgoingEdge() : it.IngoingEdge());
 					if (success)
 					{
 						nowScore = currentPath.Score(scoreFullChains_);
@@ -859,19 +1392,11 @@ namespace Sibelia
 							currentPath.DumpPath(std::cerr);
 							currentPath.DumpInstances(std::cerr);
 						}
-#endif		
+#endif
 						if (nowScore > bestScore)
 						{
 							bestScore = nowScore;
-							bestLeftSize = currentPath.LeftSize();
-							if (nowScore > 0)
-							{
-								bestInstance.clear();
-								for (auto it : currentPath.GoodInstancesList())
-								{
-									bestInstance.push_back(*it);
-								}
-							}
+							bestSize = forward ? currentPath.RightSize() : currentPath.LeftSize();
 						}
 					}
 				}
@@ -892,21 +1417,34 @@ namespace Sibelia
 		std::atomic<size_t> blocksFound_;
 		size_t progressCount_;
 		size_t progressPortion_;
-		size_t phaseSize_;
+		std::atomic<size_t> skipped_;
+		double barrierWait_;
+		std::atomic<size_t> phaseCost_;
+		std::unique_ptr<PhaseScheduler> scheduler_;
 		size_t currentBundleExplore_;
 		size_t currentPhase_;
 		size_t currentPhaseLimit_;
+		size_t phaseNumber_;
+		size_t pendingPhase_;
+		size_t pendingPhaseLimit_;
+		size_t pendingCost_;
+		bool pipelined_;
 		int64_t scalingFactor_;
 		bool scoreFullChains_;
 		int64_t lookingDepth_;
 		int64_t minBlockSize_;
 		int64_t maxBranchSize_;
 		int64_t maxFlankingSize_;
+		size_t parallelThreshold_;
+		static const int64_t PARALLEL_GRAIN = 64;
+		static const size_t ARCHIVE_BATCH = 16;
+		static const size_t ALIGN_WINDOW = 16;
 		JunctionStorage & storage_;
 		std::ofstream debugOut_;
 		std::vector<BlockInstance> blocksInstance_;
-		std::vector<InstanceVector> result_;
+		std::vector<InstanceVector> result_[2];
 		std::unordered_set<size_t> invalidChr_;
+		std::unordered_set<size_t> prevInvalidChr_;
 		std::ofstream log_;
 #ifdef _DEBUG_OUT_
 		bool debug_;
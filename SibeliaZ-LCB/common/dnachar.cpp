@@ -1,6 +1,11 @@
 #include <cassert>
 #include "dnachar.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define _DNA_CHAR_AVX2_
+#include <immintrin.h>
+#endif
+
 namespace TwoPaCo
 {
 	bool DnaChar::isValid_[CHAR_SIZE];
@@ -9,9 +14,116 @@ namespace TwoPaCo
 	const std::string DnaChar::LITERAL = "ACGT";
 	const std::string DnaChar::EXT_LITERAL = "ACGTN";
 	const std::string DnaChar::VALID_CHARS = "ACGTURYKMSWBDHWNXV";
-	
+	void (*DnaChar::reverseComplement_)(const char * src, size_t length, char * dst);
+	size_t (*DnaChar::upperValidPrefix_)(char * seq, size_t length);
+
 	namespace
 	{
+		char ToUpper(char ch)
+		{
+			return ch >= 'a' && ch <= 'z' ? ch - ('a' - 'A') : ch;
+		}
+
+		void ReverseComplementScalar(const char * src, size_t length, char * dst)
+		{
+			for (size_t i = 0; i < length; i++)
+			{
+				dst[i] = DnaChar::ReverseChar(src[length - i - 1]);
+			}
+		}
+
+		size_t UpperValidPrefixScalar(char * seq, size_t length)
+		{
+			for (size_t i = 0; i < length; i++)
+			{
+				char ch = ToUpper(seq[i]);
+				if (!DnaChar::IsValid(ch))
+				{
+					return i;
+				}
+
+				seq[i] = ch;
+			}
+
+			return length;
+		}
+
+#ifdef _DNA_CHAR_AVX2_
+		// Complement through byte comparisons: A <-> T, C <-> G, anything else is N
+		__attribute__((target("avx2")))
+		__m256i ComplementAvx2(__m256i ch)
+		{
+			__m256i isA = _mm256_cmpeq_epi8(ch, _mm256_set1_epi8('A'));
+			__m256i isC = _mm256_cmpeq_epi8(ch, _mm256_set1_epi8('C'));
+			__m256i isG = _mm256_cmpeq_epi8(ch, _mm256_set1_epi8('G'));
+			__m256i isT = _mm256_cmpeq_epi8(ch, _mm256_set1_epi8('T'));
+			__m256i ret = _mm256_blendv_epi8(_mm256_set1_epi8('N'), _mm256_set1_epi8('T'), isA);
+			ret = _mm256_blendv_epi8(ret, _mm256_set1_epi8('G'), isC);
+			ret = _mm256_blendv_epi8(ret, _mm256_set1_epi8('C'), isG);
+			return _mm256_blendv_epi8(ret, _mm256_set1_epi8('A'), isT);
+		}
+
+		__attribute__((target("avx2")))
+		void ReverseComplementAvx2(const char * src, size_t length, char * dst)
+		{
+			const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+				15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+			size_t i = 0;
+			for (; i + 32 <= length; i += 32)
+			{
+				__m256i ch = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + length - i - 32));
+				ch = _mm256_permute2x128_si256(_mm256_shuffle_epi8(ch, reverse), ch, 0x01);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), ComplementAvx2(ch));
+			}
+
+			ReverseComplementScalar(src, length - i, dst + i);
+		}
+
+		// Valid characters are all in 0x40..0x5F, so a character is checked by
+		// looking up its low nibble in the table selected by the high one
+		struct ValidNibbleTable
+		{
+			char valid[2][16];
+			ValidNibbleTable()
+			{
+				for (size_t i = 0; i < 2 * 16; i++)
+				{
+					valid[i / 16][i % 16] = DnaChar::IsValid(char(0x40 + i)) ? -1 : 0;
+				}
+			}
+		};
+
+		__attribute__((target("avx2")))
+		size_t UpperValidPrefixAvx2(char * seq, size_t length)
+		{
+			static const ValidNibbleTable table;
+			const __m256i valid4 = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table.valid[0])));
+			const __m256i valid5 = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table.valid[1])));
+			const __m256i nibble = _mm256_set1_epi8(0x0F);
+			size_t i = 0;
+			for (; i + 32 <= length; i += 32)
+			{
+				__m256i ch = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(seq + i));
+				__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(ch, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), ch));
+				ch = _mm256_andnot_si256(_mm256_and_si256(lower, _mm256_set1_epi8(0x20)), ch);
+				__m256i high = _mm256_and_si256(_mm256_srli_epi16(ch, 4), nibble);
+				__m256i low = _mm256_and_si256(ch, nibble);
+				__m256i ok = _mm256_or_si256(
+					_mm256_and_si256(_mm256_cmpeq_epi8(high, _mm256_set1_epi8(4)), _mm256_shuffle_epi8(valid4, low)),
+					_mm256_and_si256(_mm256_cmpeq_epi8(high, _mm256_set1_epi8(5)), _mm256_shuffle_epi8(valid5, low)));
+				uint32_t mask = _mm256_movemask_epi8(ok);
+				if (mask != UINT32_MAX)
+				{
+					break;
+				}
+
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(seq + i), ch);
+			}
+
+			return i + UpperValidPrefixScalar(seq + i, length - i);
+		}
+#endif
+
 		DnaChar helper;
 	}
 	
@@ -67,34 +179,50 @@ namespace TwoPaCo
 		{
 			isValid_[ch] = true;
 		}
+
+		reverseComplement_ = ReverseComplementScalar;
+		upperValidPrefix_ = UpperValidPrefixScalar;
+#ifdef _DNA_CHAR_AVX2_
+		if (__builtin_cpu_supports("avx2"))
+		{
+			reverseComplement_ = ReverseComplementAvx2;
+			upperValidPrefix_ = UpperValidPrefixAvx2;
+		}
+#endif
 	}
 
 	bool DnaChar::IsValid(char ch)
 	{
-		return isValid_[ch];
+		return isValid_[static_cast<unsigned char>(ch)];
 	}
 
 	bool DnaChar::IsDefinite(char ch)
 	{
-		return isDefinite_[ch];
+		return isDefinite_[static_cast<unsigned char>(ch)];
 	}
 
 	char DnaChar::ReverseChar(char ch)
 	{
-		return reverseTable_[ch];
+		return reverseTable_[static_cast<unsigned char>(ch)];
 	}
 
 	std::string DnaChar::ReverseCompliment(const std::string & str)
 	{
-		std::string ret;
-		for (auto it = str.rbegin(); it != str.rend(); ++it)
-		{
-			ret.push_back(DnaChar::ReverseChar(*it));
-		}
-
+		std::string ret(str.size(), 'N');
+		ReverseComplement(str.data(), str.size(), &ret[0]);
 		return ret;
 	}
 
+	void DnaChar::ReverseComplement(const char * src, size_t length, char * dst)
+	{
+		reverseComplement_(src, length, dst);
+	}
+
+	size_t DnaChar::UpperValidPrefix(char * seq, size_t length)
+	{
+		return upperValidPrefix_(seq, length);
+	}
+
 	bool DnaChar::LessSelfReverseComplement(std::string::const_iterator pit, size_t size)
 	{
 		std::string::const_reverse_iterator nit(pit + size);
@@ -17,6 +17,11 @@ namespace TwoPaCo
 		static bool IsDefinite(char ch);
 		static char ReverseChar(char ch);		
 		static std::string ReverseCompliment(const std::string & str);
+		// Writes the reverse complement of [src, src + length) to dst
+		static void ReverseComplement(const char * src, size_t length, char * dst);
+		// Upper-cases the longest prefix of valid characters in place and
+		// returns its length
+		static size_t UpperValidPrefix(char * seq, size_t length);
 		
 		static size_t MakeUpChar(char ch);
 		static char UnMakeUpChar(size_t ch);
@@ -26,6 +31,8 @@ namespace TwoPaCo
 		static bool isValid_[CHAR_SIZE];
 		static bool isDefinite_[CHAR_SIZE];	
 		static char reverseTable_[CHAR_SIZE];
+		static void (*reverseComplement_)(const char * src, size_t length, char * dst);
+		static size_t (*upperValidPrefix_)(char * seq, size_t length);
 	};
 }
 
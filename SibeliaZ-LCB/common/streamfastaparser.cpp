@@ -91,6 +91,46 @@ namespace TwoPaCo
 		return false;
 	}
 
+	// Appends the rest of the current record to the string. Runs of valid
+	// characters are upper-cased in the buffer and appended at once
+	void StreamFastaParser::GetSequence(std::string & seq)
+	{
+		while (bufferPos_ < bufferSize_ || Fill())
+		{
+			size_t run = DnaChar::UpperValidPrefix(buffer_ + bufferPos_, bufferSize_ - bufferPos_);
+			seq.append(buffer_ + bufferPos_, run);
+			bufferPos_ += run;
+			if (bufferPos_ < bufferSize_)
+			{
+				char ch = buffer_[bufferPos_];
+				if (ch == '>')
+				{
+					break;
+				}
+
+				if (!isspace(ch))
+				{
+					throw Exception("Found an invalid character '" + std::string(1, ch) + "' in sequence " + currentHeader_);
+				}
+
+				bufferPos_++;
+			}
+		}
+	}
+
+	bool StreamFastaParser::Fill()
+	{
+		if (stream_)
+		{
+			stream_.read(buffer_, BUF_SIZE);
+			bufferPos_ = 0;
+			bufferSize_ = stream_.gcount();
+			return bufferSize_ > 0;
+		}
+
+		return false;
+	}
+
 	bool StreamFastaParser::GetCh(char & ch)
 	{
 		if (bufferPos_ == bufferSize_)
@@ -25,12 +25,14 @@ namespace TwoPaCo
 		bool ReadRecord();
 		~StreamFastaParser();
 		bool GetChar(char & ch);		
+		void GetSequence(std::string & seq);
 		std::string GetErrorMessage() const;
 		std::string GetCurrentHeader() const;
 		StreamFastaParser(const std::string & fileName);
 	private:				
 		static const size_t BUF_SIZE = 1 << 20;
 
+		bool Fill();
 		bool Peek(char & ch);
 		bool GetCh(char & ch);		
 
@@ -155,12 +157,7 @@ namespace TwoPaCo
 			{
 				if (parser_->ReadRecord())
 				{
-					char ch;
-					while (parser_->GetChar(ch))
-					{
-						buf.push_back(ch);
-					}
-
+					parser_->GetSequence(buf);
 					return true;
 				}
 				else
@@ -1,42 +1,54 @@
 #ifndef _DISTANCE_KEEPER_H_
 #define _DISTANCE_KEEPER_H_
 
+#include <climits>
+
 #include "junctionstorage.h"
+#include "epochhashmap.h"
 
 namespace Sibelia
 {
 	class DistanceKeeper
 	{
 	public:
-		DistanceKeeper(int64_t vertices) : vertices_(vertices), NOT_SET(INT_MAX)
+		DistanceKeeper() : NOT_SET(INT_MAX)
 		{
-			distance_.assign(vertices_ * 2, NOT_SET);
 		}
 
 		bool IsSet(int64_t v) const
 		{
-			return distance_[v + vertices_] != NOT_SET;
+			return distance_.Contains(v);
 		}
 
 		void Set(int64_t v, int distance)
 		{
-			distance_[v + vertices_] = distance;
+			distance_[v] = distance;
 		}
 
 		int Get(int64_t v) const
 		{
-			return distance_[v + vertices_];
+			const int * ret = distance_.Find(v);
+			return ret != 0 ? *ret : NOT_SET;
 		}
 
 		void Unset(int64_t v)
 		{
-			distance_[v + vertices_] = NOT_SET;
+			distance_.Erase(v);
+		}
+
+		void Clear()
+		{
+			distance_.Clear();
+		}
+
+		bool Empty() const
+		{
+			return distance_.Empty();
 		}
 
 	private:
-		int64_t vertices_;
 		const int NOT_SET;
-		std::vector<int> distance_;
+		EpochHashMap<int> distance_;
 	};
 }
 
@@ -0,0 +1,208 @@
+#ifndef _EPOCH_HASH_MAP_H_
+#define _EPOCH_HASH_MAP_H_
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+namespace Sibelia
+{
+	// Open addressing map from 32-bit signed keys (vertex and chromosome ids)
+	// to small values, used as per-thread scratch memory. Memory is proportional
+	// to the number of keys actually stored, and Clear() takes O(1): every slot
+	// is tagged with the epoch it was written in together with the key, and
+	// slots from older epochs are considered empty.
+	template<class Value>
+	class EpochHashMap
+	{
+	public:
+		EpochHashMap(size_t initialCapacity = 64) : size_(0), epoch_(1), shift_(63)
+		{
+			size_t capacity = 2;
+			while (capacity < initialCapacity)
+			{
+				capacity <<= 1;
+				shift_--;
+			}
+
+			slot_.resize(capacity);
+		}
+
+		size_t Size() const
+		{
+			return size_;
+		}
+
+		bool Empty() const
+		{
+			return size_ == 0;
+		}
+
+		const Value * Find(int64_t key) const
+		{
+			uint64_t tag = Tag(key);
+			for (size_t idx = Hash(key);; idx = (idx + 1) & Mask())
+			{
+				const Slot & slot = slot_[idx];
+				if (slot.tag == tag)
+				{
+					return &slot.value;
+				}
+
+				if (!Live(slot))
+				{
+					return 0;
+				}
+			}
+		}
+
+		Value * Find(int64_t key)
+		{
+			return const_cast<Value*>(static_cast<const EpochHashMap&>(*this).Find(key));
+		}
+
+		bool Contains(int64_t key) const
+		{
+			return Find(key) != 0;
+		}
+
+		// Returns the value stored for the key, inserting a default one if needed
+		Value & operator[](int64_t key)
+		{
+			if ((size_ + 1) * 4 > slot_.size())
+			{
+				Grow();
+			}
+
+			uint64_t tag = Tag(key);
+			for (size_t idx = Hash(key);; idx = (idx + 1) & Mask())
+			{
+				Slot & slot = slot_[idx];
+				if (slot.tag == tag)
+				{
+					return slot.value;
+				}
+
+				if (!Live(slot))
+				{
+					size_++;
+					slot.tag = tag;
+					slot.value = Value();
+					return slot.value;
+				}
+			}
+		}
+
+		void Erase(int64_t key)
+		{
+			uint64_t tag = Tag(key);
+			size_t idx = Hash(key);
+			for (; slot_[idx].tag != tag; idx = (idx + 1) & Mask())
+			{
+				if (!Live(slot_[idx]))
+				{
+					return;
+				}
+			}
+
+			// Backward shift deletion keeps the probe sequences without tombstones
+			size_--;
+			for (size_t next = (idx + 1) & Mask(); Live(slot_[next]); next = (next + 1) & Mask())
+			{
+				size_t home = Hash(Key(slot_[next]));
+				if (((next - home) & Mask()) >= ((next - idx) & Mask()))
+				{
+					slot_[idx] = slot_[next];
+					idx = next;
+				}
+			}
+
+			slot_[idx].tag = 0;
+		}
+
+		void Clear()
+		{
+			size_ = 0;
+			if (++epoch_ == 0)
+			{
+				for (auto & slot : slot_)
+				{
+					slot.tag = 0;
+				}
+
+				epoch_ = 1;
+			}
+		}
+
+		template<class F>
+		void ForEach(F f) const
+		{
+			for (const auto & slot : slot_)
+			{
+				if (Live(slot))
+				{
+					f(Key(slot), slot.value);
+				}
+			}
+		}
+
+	private:
+
+		struct Slot
+		{
+			uint64_t tag;
+			Value value;
+			Slot() : tag(0), value() {}
+		};
+
+		size_t Mask() const
+		{
+			return slot_.size() - 1;
+		}
+
+		size_t Hash(int64_t key) const
+		{
+			return (uint64_t(uint32_t(key)) * UINT64_C(0x9E3779B97F4A7C15)) >> shift_;
+		}
+
+		uint64_t Tag(int64_t key) const
+		{
+			assert(key >= INT32_MIN && key <= INT32_MAX);
+			return (uint64_t(epoch_) << 32) | uint32_t(key);
+		}
+
+		static int64_t Key(const Slot & slot)
+		{
+			return int32_t(uint32_t(slot.tag));
+		}
+
+		bool Live(const Slot & slot) const
+		{
+			return (slot.tag >> 32) == epoch_;
+		}
+
+		void Grow()
+		{
+			std::vector<Slot> old(slot_.size() * 2);
+			old.swap(slot_);
+			shift_--;
+			for (const auto & slot : old)
+			{
+				if (Live(slot))
+				{
+					size_t idx = Hash(Key(slot));
+					for (; Live(slot_[idx]); idx = (idx + 1) & Mask());
+					slot_[idx] = slot;
+				}
+			}
+		}
+
+		size_t size_;
+		uint32_t epoch_;
+		uint32_t shift_;
+		std::vector<Slot> slot_;
+	};
+}
+
+#endif
@@ -0,0 +1,522 @@
+#ifndef _GFA_WRITER_H_
+#define _GFA_WRITER_H_
+
+#include <cctype>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+
+#include "radixsort.h"
+#include "junctionstorage.h"
+#include "outputgenerator.h"
+
+namespace Sibelia
+{
+	// Converts the alignment in MAF into a GFA1 graph as maf_to_gfa1.py does.
+	// Every block is split into segments, the runs of columns with the same
+	// rows having characters where these characters agree, and a column
+	// where they disagree gives a segment per character. The parts of the
+	// sequences not covered by the alignment become segments of their own.
+	// Every sequence is a path through the segments, and the consecutive
+	// segments of the paths are linked.
+	//
+	// The blocks are read one at a time, writing their segments and the links
+	// inside their copies right away. The occurrences of the segments are
+	// spilled into files, each for a bucket of sequences, and then the paths
+	// are made a bucket at a time. The links between the copies repeat across
+	// the sequences, so they are spilled as well, into files split by the
+	// hash of the link, and each file is deduplicated on its own at the end.
+	// The memory is then bounded by the largest of the files, which holds
+	// about a bucket's share of the occurrences or of the links
+	class GfaWriter
+	{
+	public:
+		GfaWriter(const JunctionStorage & storage) : storage_(storage)
+		{
+
+		}
+
+		void Write(const std::string & mafFileName, const std::string & gfaFileName)
+		{
+			std::ifstream maf(mafFileName.c_str());
+			std::ofstream gfaFile(gfaFileName.c_str());
+			if (!maf || !gfaFile)
+			{
+				throw std::runtime_error(("Cannot open file " + (!maf ? mafFileName : gfaFileName)).c_str());
+			}
+
+			segments_ = 0;
+			copies_ = 0;
+			MakeBuckets();
+			std::vector<std::unique_ptr<std::ofstream> > spill;
+			std::vector<std::unique_ptr<std::ofstream> > linkSpill;
+			try
+			{
+				for (size_t b = 0; b < bucketSequence_.size(); b++)
+				{
+					OpenSpill(SpillFileName(gfaFileName, "", b), spill);
+					OpenSpill(SpillFileName(gfaFileName, "link.", b), linkSpill);
+				}
+
+				OutputBuffer gfa(&gfaFile);
+				gfa.Put("H\tVN:Z:1.0\n");
+				std::string line;
+				std::vector<MafRecord> record;
+				for (size_t count = 0; ; )
+				{
+					bool eof = !std::getline(maf, line);
+					if (eof || (!line.empty() && line[0] == 'a'))
+					{
+						record.resize(count);
+						AddBlock(record, gfa, spill);
+						count = 0;
+						if (eof)
+						{
+							break;
+						}
+					}
+					else if (!line.empty() && line[0] == 's')
+					{
+						if (count == record.size())
+						{
+							record.push_back(MafRecord());
+						}
+
+						ParseRecord(line, record[count++], mafFileName);
+					}
+				}
+
+				for (size_t b = 0; b < bucketSequence_.size(); b++)
+				{
+					CloseSpill(*spill[b]);
+					AddPaths(b, SpillFileName(gfaFileName, "", b), gfa, linkSpill);
+				}
+
+				for (size_t b = 0; b < bucketSequence_.size(); b++)
+				{
+					CloseSpill(*linkSpill[b]);
+					AddLinks(SpillFileName(gfaFileName, "link.", b), gfa);
+				}
+
+				gfa.Flush();
+			}
+			catch (...)
+			{
+				for (size_t b = 0; b < spill.size(); b++)
+				{
+					spill[b].reset();
+					std::remove(SpillFileName(gfaFileName, "", b).c_str());
+				}
+
+				for (size_t b = 0; b < linkSpill.size(); b++)
+				{
+					linkSpill[b].reset();
+					std::remove(SpillFileName(gfaFileName, "link.", b).c_str());
+				}
+
+				throw;
+			}
+		}
+
+	private:
+		struct MafRecord
+		{
+			size_t chr;
+			uint64_t start;
+			bool minus;
+			std::string row;
+		};
+
+		// An occurrence of a segment in a sequence, the segment is negative if
+		// the sequence goes through its reverse complement
+		struct Occurrence
+		{
+			int64_t segment;
+			uint64_t start;
+			uint64_t length;
+			uint32_t chr;
+			uint32_t copy;
+		};
+
+		// A segment in a path, with the number of the block copy it is from
+		struct Step
+		{
+			int64_t segment;
+			uint32_t copy;
+		};
+
+		typedef std::pair<int64_t, int64_t> Link;
+
+		static std::string SpillFileName(const std::string & gfaFileName, const std::string & kind, size_t bucket)
+		{
+			std::stringstream ss;
+			ss << gfaFileName << '.' << kind << bucket << ".tmp";
+			return ss.str();
+		}
+
+		static void OpenSpill(const std::string & fileName, std::vector<std::unique_ptr<std::ofstream> > & spill)
+		{
+			spill.emplace_back(new std::ofstream(fileName.c_str(), std::ios_base::out | std::ios_base::binary));
+			if (!*spill.back())
+			{
+				throw std::runtime_error(("Cannot open file " + fileName).c_str());
+			}
+		}
+
+		static void CloseSpill(std::ofstream & spill)
+		{
+			spill.close();
+			if (!spill)
+			{
+				throw std::runtime_error("Cannot write the output");
+			}
+		}
+
+		template<class T>
+		static void ReadSpill(const std::string & fileName, std::vector<T> & data)
+		{
+			{
+				std::ifstream in(fileName.c_str(), std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+				data.resize(size_t(in.tellg()) / sizeof(T));
+				in.seekg(0);
+				in.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(T));
+				if (!in)
+				{
+					throw std::runtime_error(("Cannot read file " + fileName).c_str());
+				}
+			}
+
+			std::remove(fileName.c_str());
+		}
+
+		void MakeBuckets()
+		{
+			size_t total = 0;
+			size_t maxLength = 0;
+			for (int64_t chr = 0; chr < storage_.GetChrNumber(); chr++)
+			{
+				total += storage_.GetChrSequence(chr).size();
+				maxLength = std::max(maxLength, storage_.GetChrSequence(chr).size());
+			}
+
+			size_t capacity = std::max(maxLength, total / MAX_BUCKETS + 1);
+			bucket_.resize(storage_.GetChrNumber());
+			bucketSequence_.clear();
+			for (size_t chr = 0, now = capacity; chr < bucket_.size(); chr++)
+			{
+				size_t length = storage_.GetChrSequence(chr).size();
+				if (now + length > capacity)
+				{
+					bucketSequence_.push_back(std::vector<size_t>());
+					now = 0;
+				}
+
+				now += length;
+				bucket_[chr] = bucketSequence_.size() - 1;
+				bucketSequence_.back().push_back(chr);
+			}
+		}
+
+		void ParseRecord(std::string & line, MafRecord & record, const std::string & mafFileName) const
+		{
+			size_t begin[7];
+			size_t end[7];
+			for (size_t i = 0, pos = 0; i < 7; i++)
+			{
+				for (; pos < line.size() && isspace(line[pos]); pos++);
+				begin[i] = pos;
+				for (; pos < line.size() && !isspace(line[pos]); pos++);
+				end[i] = pos;
+				if (begin[i] == end[i])
+				{
+					throw std::runtime_error(("Malformed record in " + mafFileName).c_str());
+				}
+			}
+
+			std::string name = line.substr(begin[1], end[1] - begin[1]);
+			if (!storage_.IsSequencePresent(name))
+			{
+				throw std::runtime_error(("Unknown sequence " + name + " in " + mafFileName).c_str());
+			}
+
+			record.chr = storage_.GetSequenceId(name);
+			record.start = std::strtoull(line.c_str() + begin[2], 0, 10);
+			record.minus = line[begin[4]] == '-';
+			line.resize(end[6]);
+			line.erase(0, begin[6]);
+			record.row.swap(line);
+		}
+
+		// Whether the characters of the column except the gaps are the same
+		bool Homogeneous(const std::vector<MafRecord> & record, size_t column) const
+		{
+			char ch = '-';
+			for (const MafRecord & r : record)
+			{
+				if (r.row[column] != '-')
+				{
+					if (ch != '-' && ch != r.row[column])
+					{
+						return false;
+					}
+
+					ch = r.row[column];
+				}
+			}
+
+			return true;
+		}
+
+		bool SameGaps(const std::vector<MafRecord> & record, size_t column1, size_t column2) const
+		{
+			for (const MafRecord & r : record)
+			{
+				if ((r.row[column1] == '-') != (r.row[column2] == '-'))
+				{
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		void AddBlock(const std::vector<MafRecord> & record, OutputBuffer & gfa, std::vector<std::unique_ptr<std::ofstream> > & spill)
+		{
+			if (record.empty())
+			{
+				return;
+			}
+
+			size_t columns = record[0].row.size();
+			for (const MafRecord & r : record)
+			{
+				if (r.row.size() != columns)
+				{
+					throw std::runtime_error("Rows of different lengths in the alignment");
+				}
+			}
+
+			std::vector<size_t> row;
+			std::vector<uint64_t> pos(record.size(), 0);
+			std::vector<int64_t> last(record.size(), 0);
+			std::vector<Link> link;
+			for (size_t column = 0; column < columns; )
+			{
+				if (Homogeneous(record, column))
+				{
+					size_t end = column + 1;
+					for (; end < columns && Homogeneous(record, end) && SameGaps(record, column, end); end++);
+					row.clear();
+					for (size_t r = 0; r < record.size(); r++)
+					{
+						if (record[r].row[column] != '-')
+						{
+							row.push_back(r);
+						}
+					}
+
+					AddSegment(record, row, column, end - column, pos, last, link, gfa, spill);
+					column = end;
+				}
+				else
+				{
+					std::string ch;
+					for (const MafRecord & r : record)
+					{
+						if (r.row[column] != '-' && ch.find(r.row[column]) == std::string::npos)
+						{
+							ch.push_back(r.row[column]);
+						}
+					}
+
+					std::sort(ch.begin(), ch.end());
+					for (char c : ch)
+					{
+						row.clear();
+						for (size_t r = 0; r < record.size(); r++)
+						{
+							if (record[r].row[column] == c)
+							{
+								row.push_back(r);
+							}
+						}
+
+						AddSegment(record, row, column, 1, pos, last, link, gfa, spill);
+					}
+
+					column++;
+				}
+			}
+
+			std::sort(link.begin(), link.end());
+			link.erase(std::unique(link.begin(), link.end()), link.end());
+			for (const auto & l : link)
+			{
+				PutLink(l, gfa);
+			}
+
+			copies_ += record.size();
+		}
+
+		void AddSegment(const std::vector<MafRecord> & record,
+			const std::vector<size_t> & row,
+			size_t column,
+			size_t length,
+			std::vector<uint64_t> & pos,
+			std::vector<int64_t> & last,
+			std::vector<Link> & link,
+			OutputBuffer & gfa,
+			std::vector<std::unique_ptr<std::ofstream> > & spill)
+		{
+			if (row.empty())
+			{
+				return;
+			}
+
+			int64_t id = ++segments_;
+			gfa.Put("S\t").PutInt(id).Put('\t').Put(record[row[0]].row.data() + column, length).Put('\n');
+			for (size_t r : row)
+			{
+				const MafRecord & now = record[r];
+				uint64_t chrSize = storage_.GetChrSequence(now.chr).size();
+				uint64_t start = now.minus ? chrSize - (now.start + pos[r] + length) : now.start + pos[r];
+				Occurrence occurrence = { now.minus ? -id : id, start, length, uint32_t(now.chr), uint32_t(copies_ + r) };
+				spill[bucket_[now.chr]]->write(reinterpret_cast<const char*>(&occurrence), sizeof(occurrence));
+				if (last[r] != 0)
+				{
+					link.push_back(now.minus ? Canonical(occurrence.segment, last[r]) : Canonical(last[r], occurrence.segment));
+				}
+
+				last[r] = occurrence.segment;
+				pos[r] += length;
+			}
+		}
+
+		// Makes the paths of the sequences of the bucket from the occurrences
+		// sorted by the position, filling the gaps with the uncovered segments
+		void AddPaths(size_t bucket, const std::string & spillFileName, OutputBuffer & gfa, std::vector<std::unique_ptr<std::ofstream> > & linkSpill)
+		{
+			std::vector<Occurrence> occurrence;
+			ReadSpill(spillFileName, occurrence);
+			RadixSort(occurrence, [](const Occurrence & o) { return o.start; }, 1);
+			RadixSort(occurrence, [](const Occurrence & o) { return o.chr; }, 1);
+			OutputBuffer path;
+			auto it = occurrence.begin();
+			for (size_t chr : bucketSequence_[bucket])
+			{
+				const std::string & sequence = storage_.GetChrSequence(chr);
+				if (sequence.empty())
+				{
+					continue;
+				}
+
+				Step prev = { 0, UNCOVERED };
+				uint64_t covered = 0;
+				path.Data().clear();
+				path.Put("P\t").Put(storage_.GetChrDescription(chr)).Put('\t');
+				for (; it != occurrence.end() && it->chr == chr; ++it)
+				{
+					if (it->start < covered)
+					{
+						throw std::runtime_error("Overlapping records in the alignment of " + storage_.GetChrDescription(chr));
+					}
+
+					if (it->start > covered)
+					{
+						AddUncovered(sequence, covered, it->start, prev, gfa, path, linkSpill);
+					}
+
+					AddStep(Step{ it->segment, it->copy }, prev, gfa, path, linkSpill);
+					covered = it->start + it->length;
+				}
+
+				if (covered < sequence.size())
+				{
+					AddUncovered(sequence, covered, sequence.size(), prev, gfa, path, linkSpill);
+				}
+
+				gfa.Put(path.Put("\t*\n").Data());
+			}
+		}
+
+		void AddUncovered(const std::string & sequence,
+			uint64_t start,
+			uint64_t end,
+			Step & prev,
+			OutputBuffer & gfa,
+			OutputBuffer & path,
+			std::vector<std::unique_ptr<std::ofstream> > & linkSpill)
+		{
+			int64_t id = ++segments_;
+			gfa.Put("S\t").PutInt(id).Put('\t').Put(sequence.data() + start, end - start).Put('\n');
+			AddStep(Step{ id, UNCOVERED }, prev, gfa, path, linkSpill);
+		}
+
+		// Links the step to the previous one unless both are in the same copy
+		// of a block, then these are linked already. Links between the copies
+		// of the blocks are spilled to be written each once by AddLinks
+		void AddStep(Step step, Step & prev, OutputBuffer & gfa, OutputBuffer & path, std::vector<std::unique_ptr<std::ofstream> > & linkSpill)
+		{
+			if (prev.segment != 0)
+			{
+				path.Put(',');
+				Link link = Canonical(prev.segment, step.segment);
+				if (prev.copy == UNCOVERED || step.copy == UNCOVERED)
+				{
+					PutLink(link, gfa);
+				}
+				else if (prev.copy != step.copy)
+				{
+					uint64_t hash = uint64_t(link.first) * 0x9E3779B97F4A7C15ULL ^ uint64_t(link.second);
+					linkSpill[hash % linkSpill.size()]->write(reinterpret_cast<const char*>(&link), sizeof(link));
+				}
+			}
+
+			path.PutInt(uint64_t(std::abs(step.segment))).Put(step.segment > 0 ? '+' : '-');
+			prev = step;
+		}
+
+		// Writes the links of the file, a link is always spilled into the same
+		// file, so it is enough to remove the repeats within it
+		void AddLinks(const std::string & spillFileName, OutputBuffer & gfa)
+		{
+			std::vector<Link> link;
+			ReadSpill(spillFileName, link);
+			std::sort(link.begin(), link.end());
+			link.erase(std::unique(link.begin(), link.end()), link.end());
+			for (const Link & l : link)
+			{
+				PutLink(l, gfa);
+			}
+		}
+
+		// A link from a to b is the same as the one from -b to -a
+		static Link Canonical(int64_t a, int64_t b)
+		{
+			return std::min(std::make_pair(a, b), std::make_pair(-b, -a));
+		}
+
+		static void PutLink(Link link, OutputBuffer & gfa)
+		{
+			gfa.Put("L\t").PutInt(uint64_t(std::abs(link.first))).Put('\t').Put(link.first > 0 ? '+' : '-');
+			gfa.Put('\t').PutInt(uint64_t(std::abs(link.second))).Put('\t').Put(link.second > 0 ? '+' : '-').Put("\t*\n");
+		}
+
+		static const size_t MAX_BUCKETS = 64;
+		static const uint32_t UNCOVERED = UINT32_MAX;
+		const JunctionStorage & storage_;
+		int64_t segments_;
+		uint64_t copies_;
+		std::vector<size_t> bucket_;
+		std::vector<std::vector<size_t> > bucketSequence_;
+	};
+}
+
+#endif
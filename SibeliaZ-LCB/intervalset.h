@@ -0,0 +1,129 @@
+#ifndef _INTERVAL_SET_H_
+#define _INTERVAL_SET_H_
+
+#include <map>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+
+namespace Sibelia
+{
+	// Set of positions of a sequence kept as sorted disjoint half-open
+	// intervals, touching intervals are merged. Memory is proportional to the
+	// number of intervals, and every operation takes O(log n) plus the number
+	// of intervals it removes
+	class IntervalSet
+	{
+	public:
+		bool Contains(size_t pos) const
+		{
+			return CoveredUntil(pos) > pos;
+		}
+
+		// Returns the end of the interval containing the position, or the
+		// position itself if it is not in the set
+		size_t CoveredUntil(size_t pos) const
+		{
+			auto it = interval_.upper_bound(pos);
+			if (it != interval_.begin() && (--it)->second > pos)
+			{
+				return it->second;
+			}
+
+			return pos;
+		}
+
+		// Returns the start of the interval containing the position, or the
+		// next position if it is not in the set
+		size_t CoveredFrom(size_t pos) const
+		{
+			auto it = interval_.upper_bound(pos);
+			if (it != interval_.begin() && (--it)->second > pos)
+			{
+				return it->first;
+			}
+
+			return pos + 1;
+		}
+
+		void Insert(size_t start, size_t end)
+		{
+			if (start >= end)
+			{
+				return;
+			}
+
+			auto it = interval_.upper_bound(start);
+			if (it != interval_.begin() && std::prev(it)->second >= start)
+			{
+				--it;
+				start = it->first;
+			}
+
+			for (; it != interval_.end() && it->first <= end; it = interval_.erase(it))
+			{
+				end = std::max(end, it->second);
+			}
+
+			interval_.emplace_hint(it, start, end);
+		}
+
+		void Erase(size_t start, size_t end)
+		{
+			if (start >= end)
+			{
+				return;
+			}
+
+			auto it = interval_.upper_bound(start);
+			if (it != interval_.begin())
+			{
+				auto prev = std::prev(it);
+				size_t prevEnd = prev->second;
+				if (prevEnd > start)
+				{
+					if (prev->first < start)
+					{
+						prev->second = start;
+					}
+					else
+					{
+						interval_.erase(prev);
+					}
+
+					if (prevEnd > end)
+					{
+						interval_.emplace_hint(it, end, prevEnd);
+						return;
+					}
+				}
+			}
+
+			while (it != interval_.end() && it->first < end)
+			{
+				size_t nowEnd = it->second;
+				it = interval_.erase(it);
+				if (nowEnd > end)
+				{
+					interval_.emplace_hint(it, end, nowEnd);
+					break;
+				}
+			}
+		}
+
+		void Clear()
+		{
+			interval_.clear();
+		}
+
+		bool Empty() const
+		{
+			return interval_.empty();
+		}
+
+	private:
+		std::map<size_t, size_t> interval_;
+	};
+}
+
+#endif
@@ -8,11 +8,14 @@
 #include <memory>
 #include <cstdint>
 #include <stdexcept>
+#include <cassert>
 #include <algorithm>
 
 #include <streamfastaparser.h>
 #include <junctionapi.h>
 
+#include "usedindex.h"
+
 namespace Sibelia
 {	
 	using std::min;
@@ -21,10 +24,15 @@ namespace Sibelia
 	class Edge
 	{
 	public:
-		Edge() : startVertex_(INT64_MAX), endVertex_(INT64_MAX) {}
+		Edge() : startVertex_(INT32_MAX), endVertex_(INT32_MAX) {}
 
 		Edge(int64_t startVertex, int64_t endVertex, char ch, char revCh, int64_t length, int64_t capacity) :
-			startVertex_(startVertex), endVertex_(endVertex), ch_(ch), revCh_(revCh), length_(length), capacity_(capacity)
+			startVertex_(static_cast<int32_t>(startVertex)),
+			endVertex_(static_cast<int32_t>(endVertex)),
+			length_(static_cast<uint32_t>(length)),
+			capacity_(static_cast<uint32_t>(capacity)),
+			ch_(ch),
+			revCh_(revCh)
 		{
 
 		}
@@ -86,7 +94,7 @@ namespace Sibelia
 
 		bool Valid() const
 		{
-			return startVertex_ != INT64_MAX;
+			return startVertex_ != INT32_MAX;
 		}
 
 		bool operator == (const Edge & e) const
@@ -105,14 +113,17 @@ namespace Sibelia
 		}
 
 	private:
-		int64_t startVertex_;
-		int64_t endVertex_;		
-		int64_t length_;
-		int64_t capacity_;
+		// Vertex ids and positions are 32-bit in the storage, so are the fields
+		int32_t startVertex_;
+		int32_t endVertex_;
+		uint32_t length_;
+		uint32_t capacity_;
 		char ch_;
 		char revCh_;
 	};
 
+	static_assert(sizeof(Edge) <= 20, "Edge is copied on every push and must stay compact");
+
 	class JunctionStorage
 	{
 	private:
@@ -137,17 +148,25 @@ namespace Sibelia
 			}
 		};
 
+		// The used stamp is written by the thread finalizing a phase while the
+		// others may read it for the next one, so it is atomic. Relaxed access
+		// is enough: the visibility of a stamp is decided by its value
 		struct Position
 		{
 			int32_t id;
 			uint32_t pos;
-			bool used;
+			std::atomic<uint32_t> used;
 
-			Position(const TwoPaCo::JunctionPosition & junction) : used(false)
+			Position(const TwoPaCo::JunctionPosition & junction) : used(NOT_USED)
 			{
 				id = static_cast<int32_t>(junction.GetId());
 				pos = junction.GetPos();
 			}
+
+			Position(const Position & position) : id(position.id), pos(position.pos), used(position.used.load(std::memory_order_relaxed))
+			{
+
+			}
 		};
 
 		typedef std::vector<Vertex> VertexVector;
@@ -271,12 +290,12 @@ namespace Sibelia
 			{
 				if (IsPositiveStrand())
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_].used;
+					return JunctionStorage::this_->position_[GetChrId()][idx_].used.load(std::memory_order_relaxed) < JunctionStorage::usedVisibility_;
 				}
 				
 				if (idx_ > 0)
 				{
-					return JunctionStorage::this_->position_[GetChrId()][idx_ - 1].used;
+					return JunctionStorage::this_->position_[GetChrId()][idx_ - 1].used.load(std::memory_order_relaxed) < JunctionStorage::usedVisibility_;
 				}
 
 				return false;
@@ -286,12 +305,47 @@ namespace Sibelia
 			{
 				if (IsPositiveStrand())
 				{
-					JunctionStorage::this_->position_[GetChrId()][idx_].used = true;
+					JunctionStorage::MarkUsedFlag(GetChrId(), idx_);
 				}
 				else if (idx_ > 0)
 				{
-					JunctionStorage::this_->position_[GetChrId()][idx_ - 1].used = true;
+					JunctionStorage::MarkUsedFlag(GetChrId(), idx_ - 1);
+				}
+			}
+
+			// Returns true if any position walked from this one to end, exclusive, is used
+			bool IsUsedUntil(const JunctionSequentialIterator & end) const
+			{
+				assert(chrId_ == end.chrId_);
+				int64_t from = IsPositiveStrand() ? idx_ : end.idx_;
+				int64_t to = IsPositiveStrand() ? end.idx_ : idx_;
+				return from < to && JunctionStorage::NextUsedFlag(GetChrId(), from, to) < to;
+			}
+
+			// Returns the first used position met by operator++ starting from this one, or an invalid iterator
+			JunctionSequentialIterator NextUsed() const
+			{
+				int64_t size = JunctionStorage::this_->position_[GetChrId()].size();
+				if (IsPositiveStrand())
+				{
+					return JunctionSequentialIterator(GetChrId(), JunctionStorage::NextUsedFlag(GetChrId(), idx_, size), true);
+				}
+
+				int64_t flag = JunctionStorage::PrevUsedFlag(GetChrId(), idx_ - 1, 0);
+				return JunctionSequentialIterator(GetChrId(), flag < 0 ? -1 : flag + 1, false);
+			}
+
+			// Returns the first used position met by operator-- starting from this one, or an invalid iterator
+			JunctionSequentialIterator PrevUsed() const
+			{
+				int64_t size = JunctionStorage::this_->position_[GetChrId()].size();
+				if (IsPositiveStrand())
+				{
+					return JunctionSequentialIterator(GetChrId(), JunctionStorage::PrevUsedFlag(GetChrId(), idx_, 0), true);
 				}
+
+				int64_t flag = JunctionStorage::NextUsedFlag(GetChrId(), max(int64_t(idx_), int64_t(1)) - 1, size);
+				return JunctionSequentialIterator(GetChrId(), flag == size ? size : flag + 1, false);
 			}
 
 			JunctionSequentialIterator& operator++ ()
@@ -385,16 +439,22 @@ namespace Sibelia
 				idx_ += IsPositiveStrand() ? -step : +step;
 			}
 
-			JunctionSequentialIterator(int64_t chrId, int64_t idx, bool isPositiveStrand) : idx_(idx), chrId_(isPositiveStrand ? chrId + 1 : -(chrId + 1))
+			JunctionSequentialIterator(int64_t chrId, int64_t idx, bool isPositiveStrand) :
+				chrId_(static_cast<int32_t>(isPositiveStrand ? chrId + 1 : -(chrId + 1))),
+				idx_(static_cast<int32_t>(idx))
 			{
 
 			}
 
 			friend class JunctionStorage;
-			int64_t chrId_;
-			int64_t idx_;
+			// The strand is the sign of the chromosome id, the index may go one
+			// step past either end of the chromosome
+			int32_t chrId_;
+			int32_t idx_;
 		};
 
+		static_assert(sizeof(JunctionSequentialIterator) <= 8, "Instances hold two iterators and must stay compact");
+
 
 
 		class JunctionIterator
@@ -465,6 +525,17 @@ namespace Sibelia
 				return JunctionStorage::this_->vertex_[abs(vid_)].size();
 			}
 
+			// Hints the cache about the position of the occurrence
+			void Prefetch() const
+			{
+#ifdef __GNUC__
+				if (Valid())
+				{
+					__builtin_prefetch(&JunctionStorage::this_->position_[GetChrId()][GetIndex()]);
+				}
+#endif
+			}
+
 			JunctionIterator operator + (size_t inc) const
 			{
 				return JunctionIterator(vid_, iidx_ + inc);
@@ -617,6 +688,19 @@ namespace Sibelia
 			}
 
 
+			usedIndex_.resize(position_.size());
+			pendingIndex_.resize(position_.size());
+			for (size_t i = 0; i < position_.size(); i++)
+			{
+				if (position_[i].size() >= size_t(INT32_MAX))
+				{
+					throw std::runtime_error("Too many junctions in a single sequence");
+				}
+
+				usedIndex_[i].Init(position_[i].size());
+				pendingIndex_[i].Init(position_[i].size());
+			}
+
 			size_t record = 0;
 			sequence_.resize(position_.size());
 			for (const auto & fastaFileName : genomesFileName)
@@ -625,10 +709,7 @@ namespace Sibelia
 				{
 					sequenceDescription_.push_back(parser.GetCurrentHeader());
 					sequenceId_[parser.GetCurrentHeader()] = sequenceDescription_.size() - 1;
-					for (char ch; parser.GetChar(ch); )
-					{
-						sequence_[record].push_back(ch);
-					}
+					parser.GetSequence(sequence_[record]);
 				}
 			}
 
@@ -655,6 +736,40 @@ namespace Sibelia
 			Init(fileName, genomesFileName, threads, abundanceThreshold, loopThreshold);
 		}
 
+		// Positions are marked used with the current stamp. A thread only sees
+		// the marks with stamps below its visibility limit, which lets explorers
+		// work on a fixed snapshot while newer blocks are being marked
+		static void SetUsedStamp(uint32_t stamp)
+		{
+			usedStamp_ = stamp;
+		}
+
+		static void SetUsedVisibility(uint32_t limit)
+		{
+			usedVisibility_ = limit;
+		}
+
+		static uint32_t GetUsedVisibility()
+		{
+			return usedVisibility_;
+		}
+
+		// Moves the marks made since the last call into the index seen by all
+		// the threads. Nobody may read the used positions meanwhile
+		static void PublishUsed()
+		{
+			for (const auto & flag : this_->pendingUsed_)
+			{
+				this_->usedIndex_[flag.first].Set(flag.second);
+				this_->pendingIndex_[flag.first].Reset(flag.second);
+			}
+
+			this_->pendingUsed_.clear();
+		}
+
+		static const uint32_t NOT_USED = UINT32_MAX;
+		static const uint32_t ALL_USED_VISIBLE = UINT32_MAX;
+
 		bool IsSequencePresent(const std::string & str) const
 		{
 			return sequenceId_.count(str) > 0;
@@ -671,7 +786,7 @@ namespace Sibelia
 			{
 				for (size_t j = 0; j < position_[i].size(); j++)
 				{
-					std::cout << (position_[i][j].used ? 1 : 0);
+					std::cout << (position_[i][j].used.load(std::memory_order_relaxed) != NOT_USED ? 1 : 0);
 				}
 
 				std::cout << std::endl;
@@ -680,6 +795,48 @@ namespace Sibelia
 
 	private:
 
+		// The used flag of a position refers to the edge going to the next one.
+		// Flags are set by one thread at a time. They go into the pending index
+		// until they are published, so the threads that do not see the current
+		// stamp search only the published ones, which are all visible to them
+		static void MarkUsedFlag(uint64_t chr, int64_t flag)
+		{
+			this_->position_[chr][flag].used.store(usedStamp_, std::memory_order_relaxed);
+			if (!this_->pendingIndex_[chr].Test(flag))
+			{
+				this_->pendingIndex_[chr].Set(flag);
+				this_->pendingUsed_.push_back(std::make_pair(chr, flag));
+			}
+		}
+
+		static int64_t NextUsedFlag(uint64_t chr, int64_t from, int64_t to)
+		{
+			int64_t flag = this_->usedIndex_[chr].Next(from);
+			flag = flag == UsedIndex::NONE ? to : min(flag, to);
+			if (usedVisibility_ == ALL_USED_VISIBLE && !this_->pendingUsed_.empty())
+			{
+				int64_t pending = this_->pendingIndex_[chr].Next(from);
+				flag = pending == UsedIndex::NONE ? flag : min(flag, pending);
+			}
+
+			assert(flag == to || this_->position_[chr][flag].used.load(std::memory_order_relaxed) < usedVisibility_);
+			return flag;
+		}
+
+		static int64_t PrevUsedFlag(uint64_t chr, int64_t from, int64_t to)
+		{
+			int64_t flag = this_->usedIndex_[chr].Prev(from);
+			flag = flag == UsedIndex::NONE ? to - 1 : max(flag, to - 1);
+			if (usedVisibility_ == ALL_USED_VISIBLE && !this_->pendingUsed_.empty())
+			{
+				int64_t pending = this_->pendingIndex_[chr].Prev(from);
+				flag = pending == UsedIndex::NONE ? flag : max(flag, pending);
+			}
+
+			assert(flag == to - 1 || this_->position_[chr][flag].used.load(std::memory_order_relaxed) < usedVisibility_);
+			return flag;
+		}
+
 		struct LightEdge
 		{
 			int64_t vertex;
@@ -694,7 +851,12 @@ namespace Sibelia
 		std::vector<std::string> sequenceDescription_;		
 		std::vector<VertexVector> vertex_;
 		std::vector<std::vector<Position> > position_;
+		std::vector<UsedIndex> usedIndex_;
+		std::vector<UsedIndex> pendingIndex_;
+		std::vector<std::pair<uint64_t, int64_t> > pendingUsed_;
 		static JunctionStorage * this_;
+		static uint32_t usedStamp_;
+		static thread_local uint32_t usedVisibility_;
 	};
 }
 
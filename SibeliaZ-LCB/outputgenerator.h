@@ -1,9 +1,209 @@
 #ifndef _OUTPUT_GENERATOR_H_
 #define _OUTPUT_GENERATOR_H_
 
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+
+#include "common/dnachar.h"
+
 namespace Sibelia
 {
+	// Text output accumulated in a reusable buffer and passed to the stream in
+	// large writes. Without a stream the buffer only grows, so the text can be
+	// formatted on one thread and written on another
+	class OutputBuffer
+	{
+	public:
+		static const size_t LINE_WIDTH = 80;
+		static const size_t DEFAULT_CAPACITY = 1 << 22;
+
+		OutputBuffer(std::ostream * out = 0, size_t capacity = DEFAULT_CAPACITY) : out_(out), capacity_(capacity)
+		{
+			buffer_.reserve(out_ != 0 ? capacity_ + LINE_WIDTH + 1 : 0);
+		}
+
+		~OutputBuffer()
+		{
+			if (out_ != 0)
+			{
+				out_->write(buffer_.data(), buffer_.size());
+			}
+		}
+
+		OutputBuffer & Put(char ch)
+		{
+			buffer_.push_back(ch);
+			return Commit();
+		}
+
+		OutputBuffer & Put(const char * str, size_t length)
+		{
+			if (out_ != 0 && length >= capacity_)
+			{
+				Flush();
+				out_->write(str, length);
+				return *this;
+			}
+
+			buffer_.append(str, length);
+			return Commit();
+		}
+
+		template<size_t N>
+		OutputBuffer & Put(const char (&str)[N])
+		{
+			return Put(str, N - 1);
+		}
+
+		OutputBuffer & Put(const std::string & str)
+		{
+			return Put(str.data(), str.size());
+		}
+
+		OutputBuffer & PutInt(uint64_t x)
+		{
+			char digit[20];
+			char * pos = digit + sizeof(digit);
+			do
+			{
+				*--pos = '0' + x % 10;
+				x /= 10;
+			} while (x != 0);
+
+			return Put(pos, digit + sizeof(digit) - pos);
+		}
+
+		OutputBuffer & PutInt(int64_t x)
+		{
+			if (x < 0)
+			{
+				buffer_.push_back('-');
+				return PutInt(uint64_t(0) - uint64_t(x));
+			}
+
+			return PutInt(uint64_t(x));
+		}
+
+		// Writes the sequence split into lines of LINE_WIDTH characters, without
+		// the line break after the last one
+		OutputBuffer & PutLines(const char * seq, size_t length)
+		{
+			for (size_t i = 0; i < length; i += LINE_WIDTH)
+			{
+				if (i > 0)
+				{
+					buffer_.push_back('\n');
+				}
+
+				buffer_.append(seq + i, std::min(LINE_WIDTH, length - i));
+				Commit();
+			}
+
+			return *this;
+		}
+
+		// Same as PutLines for the reverse complement of the sequence ending
+		// right before the pointer
+		OutputBuffer & PutReverseLines(const char * seqEnd, size_t length)
+		{
+			for (size_t i = 0; i < length; i += LINE_WIDTH)
+			{
+				if (i > 0)
+				{
+					buffer_.push_back('\n');
+				}
+
+				size_t now = std::min(LINE_WIDTH, length - i);
+				size_t pos = buffer_.size();
+				buffer_.resize(pos + now);
+				TwoPaCo::DnaChar::ReverseComplement(seqEnd - i - now, now, &buffer_[pos]);
+				Commit();
+			}
+
+			return *this;
+		}
+
+		void Flush()
+		{
+			if (out_ != 0)
+			{
+				out_->write(buffer_.data(), buffer_.size());
+				buffer_.clear();
+				if (!*out_)
+				{
+					throw std::runtime_error("Cannot write the output");
+				}
+			}
+		}
+
+		std::string & Data()
+		{
+			return buffer_;
+		}
+
+	private:
+		OutputBuffer & Commit()
+		{
+			if (out_ != 0 && buffer_.size() >= capacity_)
+			{
+				Flush();
+			}
+
+			return *this;
+		}
+
+		std::ostream * out_;
+		size_t capacity_;
+		std::string buffer_;
+	};
+
+	// Writes numbered pieces of text coming from many threads to the stream in
+	// the order of their numbers. A piece that comes before the ones preceding
+	// it waits in a ring of window slots, so a piece must not be started
+	// before all the pieces at least window places back are written. Errors
+	// are left in the state of the stream
+	class OrderedOutput
+	{
+	public:
+		OrderedOutput(std::ostream & out, size_t window) : out_(out), next_(0), slot_(window), ready_(window, false)
+		{
+
+		}
+
+		// Takes the text of the piece, leaving an empty string with some
+		// capacity in its place, and writes all the pieces that are ready.
+		// Returns the number of the pieces written so far
+		size_t Submit(size_t idx, std::string & text)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			assert(idx >= next_ && idx < next_ + slot_.size());
+			slot_[idx % slot_.size()].swap(text);
+			ready_[idx % slot_.size()] = true;
+			for (size_t now = next_ % slot_.size(); ready_[now]; now = next_ % slot_.size())
+			{
+				out_.write(slot_[now].data(), slot_[now].size());
+				slot_[now].clear();
+				ready_[now] = false;
+				next_++;
+			}
+
+			return next_;
+		}
 
+	private:
+		std::ostream & out_;
+		size_t next_;
+		std::vector<std::string> slot_;
+		std::vector<char> ready_;
+		std::mutex mutex_;
+	};
 }
 
-#endif
\ No newline at end of file
+#endif
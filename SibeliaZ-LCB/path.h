@@ -1,10 +1,13 @@
 #ifndef _PATH_H_
 #define _PATH_H_
 
-#include <set>
+#include <vector>
+#include <deque>
 #include <cassert>
 #include <algorithm>
+#include <functional>
 #include "distancekeeper.h"
+#include "epochhashmap.h"
 
 
 namespace Sibelia
@@ -17,15 +20,15 @@ namespace Sibelia
 			int64_t minBlockSize,
 			int64_t minScoringUnit,
 			int64_t maxFlankingSize,
-			bool complete = false) :
-			maxBranchSize_(maxBranchSize),
+			bool complete = false,
+			size_t parallelThreshold = 0) :
+			parallelThreshold_(parallelThreshold),
+			complete_(complete),
 			minBlockSize_(minBlockSize),
 			minScoringUnit_(minScoringUnit),
+			maxBranchSize_(maxBranchSize),
 			maxFlankingSize_(maxFlankingSize),
-			storage_(&storage),
-			distanceKeeper_(storage.GetVerticesNumber()),
-			instance_(storage.GetChrNumber()),
-			complete_(complete)
+			storage_(&storage)
 		{
 
 		}
@@ -40,7 +43,7 @@ namespace Sibelia
 				auto seqIt = it.SequentialIterator();
 				if (!seqIt.IsUsed() && ch == seqIt.GetChar())
 				{
-					allInstance_.push_back(instance_[it.GetChrId()].insert(Instance(seqIt, 0)));
+					allInstance_.push_back(AddInstance(InstanceSetOf(it.GetChrId()), Instance(seqIt, 0)));
 				}
 			}
 		}
@@ -53,13 +56,13 @@ namespace Sibelia
 		struct Instance
 		{
 		private:
-			bool backFinished_;
-			bool frontFinished_;
-			int64_t compareIdx_;
 			int64_t frontDistance_;
 			int64_t backDistance_;
 			JunctionStorage::JunctionSequentialIterator front_;
 			JunctionStorage::JunctionSequentialIterator back_;
+			int32_t compareIdx_;
+			bool backFinished_;
+			bool frontFinished_;
 		public:
 
 			static bool OldComparator(const Instance & a, const Instance & b)
@@ -79,37 +82,17 @@ namespace Sibelia
 
 			}
 
-			Instance(const JunctionStorage::JunctionSequentialIterator & it, int64_t distance) : front_(it),
-				back_(it),
-				frontDistance_(distance),
+			Instance(const JunctionStorage::JunctionSequentialIterator & it, int64_t distance) : frontDistance_(distance),
 				backDistance_(distance),
-				compareIdx_(it.GetIndex()),
+				front_(it),
+				back_(it),
+				compareIdx_(static_cast<int32_t>(it.GetIndex())),
 				backFinished_(false),
 				frontFinished_(false)
 			{
 
 			}
 
-			void FinishBack()
-			{
-				backFinished_ = true;
-			}
-
-			void FinishFront()
-			{
-				frontFinished_ = true;
-			}
-
-			bool IsFinishedBack() const
-			{
-				return backFinished_;
-			}
-
-			bool IsFinishedFront() const
-			{
-				return frontFinished_;
-			}
-
 			void ChangeFront(const JunctionStorage::JunctionSequentialIterator & it, int64_t distance)
 			{
 				front_ = it;
@@ -117,7 +100,7 @@ namespace Sibelia
 				assert(backDistance_ >= frontDistance_);
 				if (!back_.IsPositiveStrand())
 				{
-					compareIdx_ = front_.GetIndex();
+					compareIdx_ = static_cast<int32_t>(front_.GetIndex());
 				}
 			}
 
@@ -128,10 +111,41 @@ namespace Sibelia
 				assert(backDistance_ >= frontDistance_);
 				if (back_.IsPositiveStrand())
 				{
-					compareIdx_ = back_.GetIndex();
+					compareIdx_ = static_cast<int32_t>(back_.GetIndex());
+				}
+			}
+
+			template<bool back>
+			void Change(const JunctionStorage::JunctionSequentialIterator & it, int64_t distance)
+			{
+				if (back)
+				{
+					ChangeBack(it, distance);
+				}
+				else
+				{
+					ChangeFront(it, distance);
 				}
 			}
 
+			template<bool back>
+			JunctionStorage::JunctionSequentialIterator End() const
+			{
+				return back ? back_ : front_;
+			}
+
+			template<bool back>
+			bool IsFinished() const
+			{
+				return back ? backFinished_ : frontFinished_;
+			}
+
+			template<bool back>
+			void Finish()
+			{
+				(back ? backFinished_ : frontFinished_) = true;
+			}
+
 			bool SinglePoint() const
 			{
 				return front_ == back_;
@@ -180,16 +194,44 @@ namespace Sibelia
 			}
 		};
 
-		typedef std::multiset<Instance> InstanceSet;
+		static_assert(sizeof(Instance) <= 40, "Instances are pooled and copied to the best set, keep them compact");
+
+		// Instances of a chromosome as a flat vector of handles sorted by
+		// Instance::operator<, equal instances kept in the insertion order.
+		// The instances themselves are stored in the pool of the path, so the
+		// handles remain valid until Clear()
+		typedef std::vector<Instance*> InstanceSet;
+
+		static bool InstanceLess(const Instance & a, const Instance * b)
+		{
+			return a < *b;
+		}
+
+		// Upper bound of the instance in the set, searched by galloping from
+		// the hint, which must not be past the answer
+		static size_t UpperBound(const InstanceSet & instanceSet, size_t hint, const Instance & inst)
+		{
+			assert(hint == 0 || !(inst < *instanceSet[hint - 1]));
+			size_t low = hint;
+			size_t high = hint;
+			for (size_t step = 1; high < instanceSet.size() && !(inst < *instanceSet[high]); step *= 2)
+			{
+				low = high + 1;
+				high += step;
+			}
+
+			high = min(high, instanceSet.size());
+			return std::upper_bound(instanceSet.begin() + low, instanceSet.begin() + high, inst, InstanceLess) - instanceSet.begin();
+		}
 
 		struct Point
 		{
 		private:
-			Edge edge;
 			int64_t startDistance;
+			Edge edge;
 		public:
 			Point() {}
-			Point(Edge edge, int64_t startDistance) : edge(edge), startDistance(startDistance) {}
+			Point(Edge edge, int64_t startDistance) : startDistance(startDistance), edge(edge) {}
 
 			Edge GetEdge() const
 			{
@@ -217,17 +259,14 @@ namespace Sibelia
 			}
 		};
 
+		static_assert(sizeof(Point) <= 32, "Points of the path body must stay compact");
+
 		int64_t Origin() const
 		{
 			return origin_;
 		}
 
-		const std::vector<InstanceSet> & Instances() const
-		{
-			return instance_;
-		}
-
-		const std::vector<InstanceSet::iterator> & AllInstances() const
+		const std::vector<Instance*> & AllInstances() const
 		{
 			return allInstance_;
 		}
@@ -345,11 +384,13 @@ namespace Sibelia
 		void DumpInstances(std::ostream & out) const
 		{
 			size_t total = 0;
-			for (auto & instanceSet : instance_)
+			for (size_t i = 0; i < instanceSetUsed_; i++)
 			{
+				auto & instanceSet = instance_[i];
 				total += instanceSet.size();
-				for (auto inst : instanceSet)
+				for (auto instPtr : instanceSet)
 				{
+					const Instance & inst = *instPtr;
 					int64_t middlePath = MiddlePathLength();
 					int64_t length = inst.UtilityLength();
 					int64_t start = inst.Front().GetIndex();
@@ -377,6 +418,7 @@ namespace Sibelia
 			}
 		}
 
+		template<bool positive>
 		bool Compatible(const JunctionStorage::JunctionSequentialIterator & start, const JunctionStorage::JunctionSequentialIterator & end, const Edge & e) const
 		{
 			if (start.IsPositiveStrand() != end.IsPositiveStrand())
@@ -384,50 +426,47 @@ namespace Sibelia
 				return false;
 			}
 
-			for (auto it = start; it != end; ++it)
+			assert(start.IsPositiveStrand() == positive);
+			if (start.IsUsedUntil(end))
 			{
-				if (it.IsUsed())
-				{
-					return false;
-				}
+				return false;
 			}
 
-			int64_t realDiff = end.GetPosition() - start.GetPosition();
-			int64_t v1 = end.GetVertexId();
-			int64_t v2 = start.GetVertexId();
+			int64_t realDiff = positive ? end.GetPosition() - start.GetPosition() : start.GetPosition() - end.GetPosition();
 			int64_t ancestralDiff = distanceKeeper_.Get(end.GetVertexId()) - distanceKeeper_.Get(start.GetVertexId());
 			assert(ancestralDiff >= 0);
-			if (start.IsPositiveStrand())
+			if (realDiff < 0)
 			{
-				if (realDiff < 0)
-				{
-					return false;
-				}
-
-				auto start1 = start.Next();
-				if ((realDiff > maxBranchSize_ || ancestralDiff > maxBranchSize_) && (!start1.Valid() || start.GetChar() != e.GetChar() || end != start1 || start1.GetVertexId() != e.GetEndVertex()))
-				{
-					return false;
-				}
+				return false;
 			}
-			else
-			{
-				if (-realDiff < 0)
-				{
-					return false;
-				}
 
-				auto start1 = start.Next();
-				if ((-realDiff > maxBranchSize_ || ancestralDiff > maxBranchSize_) && (!start1.Valid() || start.GetChar() != e.GetChar() || end != start1 || start1.GetVertexId() != e.GetEndVertex()))
-				{
-					return false;
-				}
+			auto start1 = start.Next();
+			if ((realDiff > maxBranchSize_ || ancestralDiff > maxBranchSize_) && (!start1.Valid() || start.GetChar() != e.GetChar() || end != start1 || start1.GetVertexId() != e.GetEndVertex()))
+			{
+				return false;
 			}
 
 			return true;
 		}
 
-		class PointPushFrontWorker
+		// Compatibility of an occurrence with its neighbouring instance checked
+		// before the push
+		struct Speculation
+		{
+			const Instance * neighbour;
+			JunctionStorage::JunctionSequentialIterator end;
+			bool compatible;
+		};
+
+		// Extends the instances to the occurrences of the vertex pushed to the
+		// back or to the front of the path. Occurrences of the vertex and the
+		// instances are both sorted by the chromosome and the index, so the
+		// instances are found by a merge pass over each chromosome. Updates of
+		// the instances keep them on the same side of the cursor, and new
+		// instances are inserted right at it. The direction, the strand of the
+		// occurrence and the mode of the path are template parameters
+		template<bool back, bool complete>
+		class PointPushWorker
 		{
 		public:
 			Edge e;
@@ -436,194 +475,233 @@ namespace Sibelia
 			int64_t distance;
 			bool & failFlag;
 
-			PointPushFrontWorker(Path * path, int64_t vertex, int64_t distance, Edge e, bool & failFlag) : path(path), vertex(vertex), e(e), failFlag(failFlag), distance(distance)
+			PointPushWorker(Path * path, int64_t vertex, int64_t distance, Edge e, bool & failFlag) : path(path), vertex(vertex), e(e), failFlag(failFlag), distance(distance)
 			{
 
 			}
 
 			void operator()() const
 			{
+				size_t cursor = 0;
+				uint64_t chr = UINT64_MAX;
+				InstanceSet * set = 0;
+				const Speculation * speculation = 0;
+				size_t occurrences = JunctionStorage::JunctionIterator(vertex).InstancesCount();
+				if (path->parallelThreshold_ > 0 && occurrences >= path->parallelThreshold_)
+				{
+					Speculate(occurrences);
+					speculation = &path->speculation_[0];
+				}
+
 				for (JunctionStorage::JunctionIterator nowIt(vertex); nowIt.Valid() && !failFlag; nowIt++)
 				{
-					bool newInstance = true;
-					auto seqIt = nowIt.SequentialIterator();
-					auto & instanceSet = path->instance_[nowIt.GetChrId()];
-					auto inst = instanceSet.upper_bound(Instance(seqIt, 0));
-					if (inst != instanceSet.end() && inst->Within(nowIt))
+					(nowIt + 1).Prefetch();
+					if (nowIt.GetChrId() != chr)
 					{
-						continue;
+						cursor = 0;
+						chr = nowIt.GetChrId();
+						set = &path->InstanceSetOf(chr);
 					}
 
 					if (nowIt.IsPositiveStrand())
 					{
-						if (inst != instanceSet.end() && path->Compatible(seqIt, inst->Front(), e))
-						{
-							newInstance = false;
-						}
+						Visit<true>(nowIt, *set, cursor, speculation);
 					}
 					else
 					{
-						if (inst != instanceSet.begin() && path->Compatible(seqIt, (--inst)->Front(), e))
-						{
-							newInstance = false;
-						}
+						Visit<false>(nowIt, *set, cursor, speculation);
 					}
 
-					if (!newInstance && inst->Front().GetVertexId() != vertex)
+					if (speculation != 0)
 					{
-						if (!inst->IsFinishedFront())
-						{
-							bool prevGoodInstance = path->IsGoodInstance(*inst);
-							auto & cinst = const_cast<Instance&>(*inst);
-							cinst.ChangeFront(seqIt, distance);
-							if (!prevGoodInstance && path->IsGoodInstance(*inst))
-							{
-								path->goodInstance_.push_back(inst);
-							}
-
-							if (seqIt.IsUsed())
-							{
-								cinst.FinishFront();
-							}
-						}
-					}
-					else if (!seqIt.IsUsed() && path->complete_)
-					{
-						path->allInstance_.push_back(instanceSet.insert(Instance(nowIt.SequentialIterator(), distance)));
+						speculation++;
 					}
 				}
 			}
 
-		};
-
-		class PointPushBackWorker
-		{
-		public:
-			Edge e;
-			Path * path;
-			int64_t vertex;
-			int64_t distance;
-			bool & failFlag;
+		private:
 
-			PointPushBackWorker(Path * path, int64_t vertex, int64_t distance, Edge e, bool & failFlag) : path(path), vertex(vertex), e(e), failFlag(failFlag), distance(distance)
+			// The compatibility checks of the occurrences only read the path, so
+			// for a vertex with many occurrences they are done in parallel tasks
+			// against the path as it was before the push. An occurrence uses its
+			// check only if it gets the same neighbour with the same end, so the
+			// result does not depend on the number of threads
+			void Speculate(size_t occurrences) const
 			{
+				path->speculation_.resize(occurrences);
+				uint32_t visibility = JunctionStorage::GetUsedVisibility();
+				#pragma omp taskloop grainsize(PARALLEL_GRAIN)
+				for (int64_t i = 0; i < int64_t(occurrences); i++)
+				{
+					uint32_t prevVisibility = JunctionStorage::GetUsedVisibility();
+					JunctionStorage::SetUsedVisibility(visibility);
+					auto nowIt = JunctionStorage::JunctionIterator(vertex) + i;
+					if (nowIt.IsPositiveStrand())
+					{
+						SpeculateOccurrence<true>(nowIt, path->speculation_[i]);
+					}
+					else
+					{
+						SpeculateOccurrence<false>(nowIt, path->speculation_[i]);
+					}
 
+					JunctionStorage::SetUsedVisibility(prevVisibility);
+				}
 			}
 
-			void operator()() const
+			template<bool positive>
+			void SpeculateOccurrence(const JunctionStorage::JunctionIterator & nowIt, Speculation & speculation) const
 			{
-				for (JunctionStorage::JunctionIterator nowIt(vertex); nowIt.Valid() && !failFlag; nowIt++)
+				speculation.neighbour = 0;
+				const InstanceSet * instanceSet = path->FindInstanceSet(nowIt.GetChrId());
+				if (instanceSet != 0)
 				{
-					bool newInstance = true;
 					auto seqIt = nowIt.SequentialIterator();
-					auto & instanceSet = path->instance_[nowIt.GetChrId()];
-					auto inst = instanceSet.upper_bound(Instance(seqIt, 0));
-					if (inst != instanceSet.end() && inst->Within(nowIt))
+					auto inst = std::upper_bound(instanceSet->begin(), instanceSet->end(), Instance(seqIt, 0), InstanceLess);
+					const bool preceding = back == positive;
+					if (preceding ? inst != instanceSet->begin() : inst != instanceSet->end())
 					{
-						continue;
+						if (preceding)
+						{
+							--inst;
+						}
+
+						speculation.neighbour = *inst;
+						speculation.end = (*inst)->End<back>();
+						speculation.compatible = back ? path->Compatible<positive>(speculation.end, seqIt, e) : path->Compatible<positive>(seqIt, speculation.end, e);
 					}
+				}
+			}
 
-					if (nowIt.IsPositiveStrand())
+			template<bool positive>
+			void Visit(const JunctionStorage::JunctionIterator & nowIt, InstanceSet & instanceSet, size_t & cursor, const Speculation * speculation) const
+			{
+				auto seqIt = nowIt.SequentialIterator();
+				cursor = UpperBound(instanceSet, cursor, Instance(seqIt, 0));
+				auto inst = instanceSet.begin() + cursor;
+				if (inst != instanceSet.end() && (*inst)->Within(nowIt))
+				{
+					return;
+				}
+
+				// Pushing to the back extends the instance preceding a positive
+				// occurrence, pushing to the front the one preceding a negative one
+				const bool preceding = back == positive;
+				bool newInstance = true;
+				if (preceding ? inst != instanceSet.begin() : inst != instanceSet.end())
+				{
+					if (preceding)
 					{
-						if (inst != instanceSet.begin() && path->Compatible((--inst)->Back(), seqIt, e))
-						{
-							newInstance = false;
-						}
+						--inst;
 					}
-					else
+
+					auto end = (*inst)->End<back>();
+					if (speculation != 0 && speculation->neighbour == *inst && speculation->end == end)
 					{
-						if (inst != instanceSet.end() && path->Compatible(inst->Back(), seqIt, e))
-						{
-							newInstance = false;
-						}
+						newInstance = !speculation->compatible;
 					}
+					else if (back ? path->Compatible<positive>(end, seqIt, e) : path->Compatible<positive>(seqIt, end, e))
+					{
+						newInstance = false;
+					}
+				}
 
-					if (!newInstance && inst->Back().GetVertexId() != vertex)
+				if (!newInstance && (*inst)->End<back>().GetVertexId() != vertex)
+				{
+					if (!(*inst)->IsFinished<back>())
 					{
-						if (!inst->IsFinishedBack())
+						auto & cinst = **inst;
+						path->ChangeEnd<back>(cinst, seqIt, distance);
+						if (seqIt.IsUsed())
 						{
-							bool prevGoodInstance = path->IsGoodInstance(*inst);
-							auto & cinst = const_cast<Instance&>(*inst);
-							cinst.ChangeBack(nowIt.SequentialIterator(), distance);
-							if (!prevGoodInstance && path->IsGoodInstance(*inst))
-							{
-								path->goodInstance_.push_back(inst);
-							}
-
-							if (seqIt.IsUsed())
-							{
-								cinst.FinishBack();
-							}
+							cinst.Finish<back>();
 						}
 					}
-					else if (!seqIt.IsUsed() && path->complete_)
-					{
-						path->allInstance_.push_back(instanceSet.insert(Instance(nowIt.SequentialIterator(), distance)));
-					}
+				}
+				else if (complete && !seqIt.IsUsed())
+				{
+					path->allInstance_.push_back(path->AddInstance(instanceSet, cursor++, Instance(seqIt, distance)));
 				}
 			}
 
 		};
 
-		bool PointPushBack(const Edge & e)
+		template<bool back>
+		bool PointPush(const Edge & e)
 		{
-			int64_t vertex = e.GetEndVertex();
+			int64_t vertex = back ? e.GetEndVertex() : e.GetStartVertex();
 			if (distanceKeeper_.IsSet(vertex))
 			{
 				return false;
 			}
 
 			bool failFlag = false;
-			int64_t startVertexDistance = rightBodyFlank_;
-			int64_t endVertexDistance = startVertexDistance + e.GetLength();
-			distanceKeeper_.Set(e.GetEndVertex(), int(endVertexDistance));
-			PointPushBackWorker(this, vertex, endVertexDistance, e, failFlag)();
-			rightBody_.push_back(Point(e, startVertexDistance));
-			rightBodyFlank_ = rightBody_.back().EndDistance();
-			return !failFlag;
-		}
+			BeginPush(back);
+			int64_t vertexDistance = back ? rightBodyFlank_ + e.GetLength() : leftBodyFlank_ - e.GetLength();
+			distanceKeeper_.Set(vertex, int(vertexDistance));
+			if (complete_)
+			{
+				PointPushWorker<back, true>(this, vertex, vertexDistance, e, failFlag)();
+			}
+			else
+			{
+				PointPushWorker<back, false>(this, vertex, vertexDistance, e, failFlag)();
+			}
 
-		bool PointPushFront(const Edge & e)
-		{
-			int64_t vertex = e.GetStartVertex();
-			if (distanceKeeper_.IsSet(vertex))
+			if (back)
 			{
-				return false;
+				rightBody_.push_back(Point(e, rightBodyFlank_));
+				rightBodyFlank_ = vertexDistance;
+			}
+			else
+			{
+				leftBody_.push_back(Point(e, vertexDistance));
+				leftBodyFlank_ = vertexDistance;
 			}
 
-			bool failFlag = false;
-			int64_t endVertexDistance = leftBodyFlank_;
-			int64_t startVertexDistance = endVertexDistance - e.GetLength();
-			distanceKeeper_.Set(e.GetStartVertex(), int(startVertexDistance));
-			PointPushFrontWorker(this, vertex, startVertexDistance, e, failFlag)();
-			leftBody_.push_back(Point(e, startVertexDistance));
-			leftBodyFlank_ = leftBody_.back().StartDistance();
+			PruneFlankHeaps();
 			return !failFlag;
 		}
 
+		bool PointPushBack(const Edge & e)
+		{
+			return PointPush<true>(e);
+		}
+
+		bool PointPushFront(const Edge & e)
+		{
+			return PointPush<false>(e);
+		}
+
+		// The score of a good instance is its real length minus the square of
+		// (RightDistance() - RightFlankDistance()) + (LeftDistance() + LeftFlankDistance()),
+		// which equals MiddlePathLength() - UtilityLength(). Expanding the square
+		// gives the total from the sums of the lengths, the utility lengths and
+		// their squares, which are updated only for the instances a push changes.
+		// The squares of whole lengths may overflow, so the expansion is done in
+		// unsigned arithmetic; it is exact modulo 2^64 and the penalty fits
+		// into int64_t
 		int64_t Score(bool final = false) const
 		{
 			int64_t ret = 0;
-			for (auto & instanceIt : goodInstance_)
+			if (!goodInstance_.empty())
 			{
-				int64_t score = instanceIt->RealLength();
-				int64_t rightPenalty = RightDistance() - instanceIt->RightFlankDistance();
-				int64_t leftPenalty = LeftDistance() + instanceIt->LeftFlankDistance();
-				assert(rightPenalty >= 0);
-				assert(leftPenalty >= 0);
-				if (leftPenalty >= maxFlankingSize_  || rightPenalty >= maxFlankingSize_)
+				int64_t rightPenalty = RightDistance() - backFlankHeap_.front().first;
+				int64_t leftPenalty = LeftDistance() + frontFlankHeap_.front().first;
+				if (leftPenalty >= maxFlankingSize_ || rightPenalty >= maxFlankingSize_)
 				{
 					ret = -INT32_MAX;
-					break;
 				}
 				else
 				{
-					score -= (rightPenalty + leftPenalty) * (rightPenalty + leftPenalty);
+					uint64_t middle = MiddlePathLength();
+					uint64_t count = goodInstance_.size();
+					uint64_t penalty = count * middle * middle - 2 * middle * uint64_t(goodUtility_) + goodUtilitySquare_;
+					ret = goodLength_ - int64_t(penalty);
 				}
-
-				ret += score;
 			}
 
+			assert(ret == RescanScore());
 			return ret;
 		}
 
@@ -632,12 +710,12 @@ namespace Sibelia
 			return goodInstance_.size();
 		}
 
-		static bool CmpInstance(const InstanceSet::iterator & a, const InstanceSet::iterator & b)
+		static bool CmpInstance(const Instance * a, const Instance * b)
 		{
 			return Path::Instance::OldComparator(*a, *b);
 		}
 
-		const std::vector<InstanceSet::iterator> & GoodInstancesList() const
+		const std::vector<Instance*> & GoodInstancesList() const
 		{
 			return goodInstance_;
 		}
@@ -647,6 +725,64 @@ namespace Sibelia
 			return inst.RealLength() >= minBlockSize_;
 		}
 
+		// Undoes the latest pushes until the sides have the given sizes, in time
+		// proportional to the work of the undone pushes. The sides must have
+		// been extended one after another, as ProcessVertex does
+		void RollBack(size_t rightSize, size_t leftSize)
+		{
+			while (RightSize() > rightSize || LeftSize() > leftSize)
+			{
+				const PushRecord & push = push_.back();
+				assert(push.back ? RightSize() > rightSize : LeftSize() > leftSize);
+				while (change_.size() > push.change)
+				{
+					const Change & change = change_.back();
+					if (change.instanceSet != 0)
+					{
+						change.instanceSet->erase(change.instanceSet->begin() + change.pos);
+						allInstance_.pop_back();
+						poolUsed_--;
+					}
+					else
+					{
+						*change.instance = change.old;
+					}
+
+					change_.pop_back();
+				}
+
+				goodInstance_.resize(push.good);
+				goodLength_ = push.goodLength;
+				goodUtility_ = push.goodUtility;
+				goodUtilitySquare_ = push.goodUtilitySquare;
+				if (push.back)
+				{
+					distanceKeeper_.Unset(rightBody_.back().GetEdge().GetEndVertex());
+					rightBody_.pop_back();
+					rightBodyFlank_ = rightBody_.empty() ? 0 : rightBody_.back().EndDistance();
+				}
+				else
+				{
+					distanceKeeper_.Unset(leftBody_.back().GetEdge().GetStartVertex());
+					leftBody_.pop_back();
+					leftBodyFlank_ = leftBody_.empty() ? 0 : leftBody_.back().StartDistance();
+				}
+
+				push_.pop_back();
+			}
+
+			frontFlankHeap_.clear();
+			backFlankHeap_.clear();
+			for (auto inst : goodInstance_)
+			{
+				frontFlankHeap_.push_back(FlankEntry(inst->LeftFlankDistance(), inst));
+				backFlankHeap_.push_back(FlankEntry(inst->RightFlankDistance(), inst));
+			}
+
+			std::make_heap(frontFlankHeap_.begin(), frontFlankHeap_.end());
+			std::make_heap(backFlankHeap_.begin(), backFlankHeap_.end(), std::greater<FlankEntry>());
+		}
+
 		void Clear()
 		{
 			for (auto pt : leftBody_)
@@ -662,27 +798,247 @@ namespace Sibelia
 			leftBody_.clear();
 			rightBody_.clear();
 			distanceKeeper_.Unset(origin_);
-			for (int64_t v1 = -storage_->GetVerticesNumber() + 1; v1 < storage_->GetVerticesNumber(); v1++)
-			{
-				assert(!distanceKeeper_.IsSet(v1));
-			}
-
-			for (auto it : allInstance_)
+			assert(distanceKeeper_.Empty());
+			for (size_t i = 0; i < instanceSetUsed_; i++)
 			{
-				instance_[it->Front().GetChrId()].erase(it);
+				instance_[i].clear();
 			}
 
+			chrInstanceSet_.Clear();
+			instanceSetUsed_ = 0;
+			poolUsed_ = 0;
 			allInstance_.clear();
 			goodInstance_.clear();
+			goodLength_ = goodUtility_ = goodUtilitySquare_ = 0;
+			frontFlankHeap_.clear();
+			backFlankHeap_.clear();
+			change_.clear();
+			push_.clear();
 		}
 
 	private:
 
+		// Every push records the state needed to undo it: the score sums, the
+		// size of the good instance list and the position of its changes in
+		// the log. A change is either the previous value of an instance or an
+		// instance created at the given position of a set
+		struct PushRecord
+		{
+			bool back;
+			size_t good;
+			size_t change;
+			int64_t goodLength;
+			int64_t goodUtility;
+			uint64_t goodUtilitySquare;
+		};
+
+		struct Change
+		{
+			Instance * instance;
+			Instance old;
+			InstanceSet * instanceSet;
+			size_t pos;
+		};
+
+		void BeginPush(bool back)
+		{
+			PushRecord push;
+			push.back = back;
+			push.good = goodInstance_.size();
+			push.change = change_.size();
+			push.goodLength = goodLength_;
+			push.goodUtility = goodUtility_;
+			push.goodUtilitySquare = goodUtilitySquare_;
+			push_.push_back(push);
+		}
+
+		void LogChange(Instance * instance, InstanceSet * instanceSet, size_t pos)
+		{
+			if (!push_.empty())
+			{
+				change_.push_back(Change());
+				change_.back().instance = instance;
+				change_.back().old = *instance;
+				change_.back().instanceSet = instanceSet;
+				change_.back().pos = pos;
+			}
+		}
+
+		const InstanceSet * FindInstanceSet(uint64_t chr) const
+		{
+			const size_t * idx = chrInstanceSet_.Find(chr);
+			return idx != 0 ? &instance_[*idx - 1] : 0;
+		}
+
+		// Instance sets are only allocated for the chromosomes the path touches
+		// and are reused between the paths
+		InstanceSet & InstanceSetOf(uint64_t chr)
+		{
+			size_t & idx = chrInstanceSet_[chr];
+			if (idx == 0)
+			{
+				if (instanceSetUsed_ == instance_.size())
+				{
+					instance_.push_back(InstanceSet());
+				}
+
+				idx = ++instanceSetUsed_;
+			}
+
+			return instance_[idx - 1];
+		}
+
+		typedef std::pair<int64_t, const Instance*> FlankEntry;
+
+		template<bool back>
+		void ChangeEnd(Instance & inst, const JunctionStorage::JunctionSequentialIterator & it, int64_t distance)
+		{
+			LogChange(&inst, 0, 0);
+			bool prevGoodInstance = IsGoodInstance(inst);
+			RemoveScore(inst, prevGoodInstance);
+			inst.Change<back>(it, distance);
+			if (AddScore(inst, prevGoodInstance))
+			{
+				PushFlank<back>(inst);
+			}
+		}
+
+		template<bool back>
+		void PushFlank(const Instance & inst)
+		{
+			if (back)
+			{
+				backFlankHeap_.push_back(FlankEntry(inst.RightFlankDistance(), &inst));
+				std::push_heap(backFlankHeap_.begin(), backFlankHeap_.end(), std::greater<FlankEntry>());
+			}
+			else
+			{
+				frontFlankHeap_.push_back(FlankEntry(inst.LeftFlankDistance(), &inst));
+				std::push_heap(frontFlankHeap_.begin(), frontFlankHeap_.end());
+			}
+		}
+
+		void RemoveScore(const Instance & inst, bool good)
+		{
+			if (good)
+			{
+				uint64_t utility = inst.UtilityLength();
+				goodLength_ -= inst.RealLength();
+				goodUtility_ -= int64_t(utility);
+				goodUtilitySquare_ -= utility * utility;
+			}
+		}
+
+		// Returns true if the instance is good and its flank entry has to be
+		// updated; an instance that just became good also gets the other one
+		bool AddScore(Instance & inst, bool prevGoodInstance)
+		{
+			if (!IsGoodInstance(inst))
+			{
+				return false;
+			}
+
+			uint64_t utility = inst.UtilityLength();
+			goodLength_ += inst.RealLength();
+			goodUtility_ += int64_t(utility);
+			goodUtilitySquare_ += utility * utility;
+			if (!prevGoodInstance)
+			{
+				goodInstance_.push_back(&inst);
+				PushFlank<false>(inst);
+				PushFlank<true>(inst);
+				return false;
+			}
+
+			return true;
+		}
+
+		// The flank heaps keep the largest left and the smallest right flank
+		// distance of the good instances on top. Flank distances of an instance
+		// only grow outwards, so an entry that does not match the instance
+		// anymore is outdated and is dropped once it surfaces
+		void PruneFlankHeaps()
+		{
+			while (!frontFlankHeap_.empty() && frontFlankHeap_.front().first != frontFlankHeap_.front().second->LeftFlankDistance())
+			{
+				std::pop_heap(frontFlankHeap_.begin(), frontFlankHeap_.end());
+				frontFlankHeap_.pop_back();
+			}
+
+			while (!backFlankHeap_.empty() && backFlankHeap_.front().first != backFlankHeap_.front().second->RightFlankDistance())
+			{
+				std::pop_heap(backFlankHeap_.begin(), backFlankHeap_.end(), std::greater<FlankEntry>());
+				backFlankHeap_.pop_back();
+			}
+		}
+
+		int64_t RescanScore() const
+		{
+			int64_t ret = 0;
+			for (auto & instanceIt : goodInstance_)
+			{
+				int64_t score = instanceIt->RealLength();
+				int64_t rightPenalty = RightDistance() - instanceIt->RightFlankDistance();
+				int64_t leftPenalty = LeftDistance() + instanceIt->LeftFlankDistance();
+				assert(rightPenalty >= 0);
+				assert(leftPenalty >= 0);
+				if (leftPenalty >= maxFlankingSize_ || rightPenalty >= maxFlankingSize_)
+				{
+					ret = -INT32_MAX;
+					break;
+				}
+				else
+				{
+					score -= (rightPenalty + leftPenalty) * (rightPenalty + leftPenalty);
+				}
+
+				ret += score;
+			}
+
+			return ret;
+		}
+
+		Instance * AddInstance(InstanceSet & instanceSet, const Instance & inst)
+		{
+			return AddInstance(instanceSet, std::upper_bound(instanceSet.begin(), instanceSet.end(), inst, InstanceLess) - instanceSet.begin(), inst);
+		}
+
+		Instance * AddInstance(InstanceSet & instanceSet, size_t pos, const Instance & inst)
+		{
+			if (poolUsed_ == pool_.size())
+			{
+				pool_.push_back(inst);
+			}
+			else
+			{
+				pool_[poolUsed_] = inst;
+			}
+
+			Instance * ret = &pool_[poolUsed_++];
+			instanceSet.insert(instanceSet.begin() + pos, ret);
+			LogChange(ret, &instanceSet, pos);
+			return ret;
+		}
+
 		std::vector<Point> leftBody_;
 		std::vector<Point> rightBody_;
-		std::vector<InstanceSet> instance_;
-		std::vector<InstanceSet::iterator> allInstance_;
-		std::vector<InstanceSet::iterator> goodInstance_;
+		std::deque<InstanceSet> instance_;
+		size_t instanceSetUsed_ = 0;
+		EpochHashMap<size_t> chrInstanceSet_;
+		std::deque<Instance> pool_;
+		size_t poolUsed_ = 0;
+		std::vector<Instance*> allInstance_;
+		std::vector<Instance*> goodInstance_;
+		int64_t goodLength_ = 0;
+		int64_t goodUtility_ = 0;
+		uint64_t goodUtilitySquare_ = 0;
+		std::vector<FlankEntry> frontFlankHeap_;
+		std::vector<FlankEntry> backFlankHeap_;
+		std::vector<Change> change_;
+		std::vector<PushRecord> push_;
+		std::vector<Speculation> speculation_;
+		size_t parallelThreshold_;
+		static const int64_t PARALLEL_GRAIN = 64;
 
 		bool complete_;
 		int64_t origin_;
@@ -0,0 +1,110 @@
+#ifndef _PHASE_SCHEDULER_H_
+#define _PHASE_SCHEDULER_H_
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+namespace Sibelia
+{
+	// Chooses the number of bundles explored in parallel between two barriers.
+	// The size of the next phase depends only on the statistics of the previous
+	// ones (conflicts found by the validation and the amount of path extension
+	// work done), which are deterministic for a fixed input and thread count.
+	class PhaseScheduler
+	{
+	public:
+		struct PhaseStats
+		{
+			size_t start;
+			size_t size;
+			size_t failures;
+			size_t cost;
+
+			PhaseStats(size_t start, size_t size, size_t failures, size_t cost) : start(start), size(size), failures(failures), cost(cost)
+			{
+
+			}
+
+			double FailureRate() const
+			{
+				return size > 0 ? double(failures) / size : 0;
+			}
+		};
+
+		PhaseScheduler(size_t threads, bool adaptive, size_t fixedSize = FIXED_PHASE_SIZE) :
+			threads_(std::max(threads, size_t(1))), adaptive_(adaptive), fixedSize_(fixedSize)
+		{
+			minSize_ = threads_;
+			maxSize_ = std::max(minSize_, threads_ * MAX_BUNDLES_PER_THREAD);
+			cap_ = adaptive_ ? std::max(minSize_, threads_ * START_BUNDLES_PER_THREAD) : fixedSize_;
+		}
+
+		size_t MaxPhaseSize() const
+		{
+			return adaptive_ ? maxSize_ : fixedSize_;
+		}
+
+		size_t FirstPhaseSize() const
+		{
+			return cap_;
+		}
+
+		void Record(size_t start, size_t size, size_t failures, size_t cost)
+		{
+			stats_.push_back(PhaseStats(start, size, failures, cost));
+			if (adaptive_ && size > 0)
+			{
+				// Multiplicative decrease on conflicts, additive increase otherwise
+				double rate = stats_.back().FailureRate();
+				if (rate > HIGH_FAILURE_RATE)
+				{
+					cap_ = std::max(minSize_, cap_ / 2);
+				}
+				else if (rate < LOW_FAILURE_RATE)
+				{
+					cap_ = std::min(maxSize_, cap_ + threads_ * START_BUNDLES_PER_THREAD);
+				}
+			}
+		}
+
+		size_t NextPhaseSize() const
+		{
+			if (!adaptive_ || stats_.empty())
+			{
+				return cap_;
+			}
+
+			// Enough bundles to give every thread a fair amount of work, but
+			// never more than the conflict rate allows
+			const PhaseStats & last = stats_.back();
+			size_t avgCost = std::max(size_t(1), last.cost / std::max(size_t(1), last.size));
+			size_t byCost = threads_ * WORK_PER_THREAD / avgCost;
+			return std::max(minSize_, std::min(cap_, byCost));
+		}
+
+		const std::vector<PhaseStats> & Stats() const
+		{
+			return stats_;
+		}
+
+		static const size_t FIXED_PHASE_SIZE = 256;
+
+	private:
+		static const size_t START_BUNDLES_PER_THREAD = 16;
+		static const size_t MAX_BUNDLES_PER_THREAD = 512;
+		static const size_t WORK_PER_THREAD = 1 << 14;
+		static constexpr double LOW_FAILURE_RATE = 0.01;
+		static constexpr double HIGH_FAILURE_RATE = 0.05;
+
+		size_t threads_;
+		bool adaptive_;
+		size_t fixedSize_;
+		size_t minSize_;
+		size_t maxSize_;
+		size_t cap_;
+		std::vector<PhaseStats> stats_;
+	};
+}
+
+#endif
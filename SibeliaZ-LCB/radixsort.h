@@ -0,0 +1,80 @@
+#ifndef _RADIX_SORT_H_
+#define _RADIX_SORT_H_
+
+#include <omp.h>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace Sibelia
+{
+	// Stable LSD radix sort by an unsigned 64-bit key taken from the elements.
+	// Passes are made only over the digits of the largest key. In each pass
+	// the array is split into chunks, one per thread: the digits of every
+	// chunk are counted, and then the chunks are scattered to the positions
+	// given by the prefix sums over the digits and the chunks. Sorting by
+	// several keys is done by calling it from the least significant key
+	template<class T, class Key>
+	void RadixSort(std::vector<T> & data, Key key, size_t threads)
+	{
+		const size_t BITS = 8;
+		const size_t RADIX = size_t(1) << BITS;
+		const size_t MIN_CHUNK = 1 << 14;
+		uint64_t maxKey = 0;
+		for (const T & x : data)
+		{
+			maxKey = std::max(maxKey, uint64_t(key(x)));
+		}
+
+		if (data.size() < 2 || maxKey == 0)
+		{
+			return;
+		}
+
+		int64_t chunks = std::max(size_t(1), std::min(threads, data.size() / MIN_CHUNK));
+		size_t chunkSize = (data.size() + chunks - 1) / chunks;
+		std::vector<T> buffer(data.size());
+		std::vector<size_t> count(chunks * RADIX);
+		for (size_t shift = 0; shift < 64 && (maxKey >> shift) > 0; shift += BITS)
+		{
+			std::fill(count.begin(), count.end(), 0);
+			#pragma omp parallel for num_threads(chunks)
+			for (int64_t c = 0; c < chunks; c++)
+			{
+				size_t * now = &count[c * RADIX];
+				size_t end = std::min(data.size(), (c + 1) * chunkSize);
+				for (size_t i = c * chunkSize; i < end; i++)
+				{
+					now[(uint64_t(key(data[i])) >> shift) & (RADIX - 1)]++;
+				}
+			}
+
+			size_t offset = 0;
+			for (size_t digit = 0; digit < RADIX; digit++)
+			{
+				for (int64_t c = 0; c < chunks; c++)
+				{
+					size_t size = count[c * RADIX + digit];
+					count[c * RADIX + digit] = offset;
+					offset += size;
+				}
+			}
+
+			#pragma omp parallel for num_threads(chunks)
+			for (int64_t c = 0; c < chunks; c++)
+			{
+				size_t * now = &count[c * RADIX];
+				size_t end = std::min(data.size(), (c + 1) * chunkSize);
+				for (size_t i = c * chunkSize; i < end; i++)
+				{
+					buffer[now[(uint64_t(key(data[i])) >> shift) & (RADIX - 1)]++] = data[i];
+				}
+			}
+
+			data.swap(buffer);
+		}
+	}
+}
+
+#endif
@@ -104,6 +104,83 @@ int main(int argc, char * argv[])
 			cmd,
 			false);
 
+		TCLAP::SwitchArg archive("",
+			"archive",
+			"Output blocks sequences into a single file blocks.fa indexed by blocks.fa.idx",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg align("",
+			"align",
+			"Globally align the blocks and write the alignment into alignment.maf",
+			false);
+
+		TCLAP::ValueArg<std::string> mafCmd("",
+			"mafcmd",
+			"Command line recorded in the header of alignment.maf",
+			false,
+			"",
+			"string");
+
+		TCLAP::ValueArg<unsigned int> alignMemory("",
+			"alignmemory",
+			"Memory budget for the alignment of the blocks in megabytes, 0 is unlimited",
+			false,
+			0,
+			"integer");
+
+		TCLAP::ValueArg<unsigned int> alignThreads("",
+			"alignthreads",
+			"Number of threads aligning the blocks, 0 is the number of worker threads",
+			false,
+			0,
+			"integer");
+
+		TCLAP::SwitchArg anchored("",
+			"anchored",
+			"Align only the windows between the junctions shared by all copies of a block",
+			false);
+
+		TCLAP::SwitchArg gfa("",
+			"gfa",
+			"Convert the alignment into a GFA1 graph written into alignment.gfa, requires --align",
+			false);
+
+#ifdef _USE_SPOA_
+		cmd.add(gfa);
+		cmd.add(anchored);
+		cmd.add(align);
+		cmd.add(mafCmd);
+		cmd.add(alignMemory);
+		cmd.add(alignThreads);
+#endif
+
+		TCLAP::SwitchArg adaptivePhases("",
+			"adaptive",
+			"Size exploration phases by the observed conflict rate and work (deterministic for a fixed number of threads)",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg pipelined("",
+			"pipeline",
+			"Explore the next phase while the previous one is being validated. The explorers do not see the blocks of the phase being validated, so more seeds are recomputed as conflicts and the blocks may differ from the default mode",
+			cmd,
+			false);
+
+		TCLAP::SwitchArg localityOrder("",
+			"locality",
+			"Order seeds of equal multiplicity by their position in the genomes",
+			cmd,
+			false);
+
+		TCLAP::ValueArg<unsigned int> intraSeed("",
+			"intraseed",
+			"Extend seeds with at least this many occurrences using parallel tasks, 0 disables",
+			false,
+			0,
+			"integer",
+			cmd);
+
 		TCLAP::UnlabeledMultiArg<std::string> genomesFileName("filenames",
 			"FASTA file(s) with nucleotide sequences.",
 			true,
@@ -111,6 +188,10 @@ int main(int argc, char * argv[])
 			cmd);
 
 		cmd.parse(argc, argv);
+		if (gfa.getValue() && !align.getValue())
+		{
+			throw std::runtime_error("--gfa requires --align");
+		}
 
 		std::cout << "Loading the graph..." << std::endl;
 		Sibelia::JunctionStorage storage(inFileName.getValue(),
@@ -128,10 +209,14 @@ int main(int argc, char * argv[])
 			8,
 			0,
 			threads.getValue(),
-			outDirName.getValue() + "/paths.txt");
+			outDirName.getValue() + "/paths.txt",
+			adaptivePhases.getValue(),
+			pipelined.getValue(),
+			localityOrder.getValue(),
+			intraSeed.getValue());
 
 		std::cout << "Generating the output..." << std::endl;
-		finder.GenerateOutput(outDirName.getValue(), !noSeq.getValue());
+		finder.GenerateOutput(outDirName.getValue(), !noSeq.getValue(), archive.getValue(), align.getValue(), mafCmd.getValue(), size_t(alignMemory.getValue()) << 20, alignThreads.getValue() > 0 ? alignThreads.getValue() : threads.getValue(), anchored.getValue(), gfa.getValue());
 	}
 	catch (TCLAP::ArgException & e)
 	{
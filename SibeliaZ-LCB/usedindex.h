@@ -0,0 +1,196 @@
+#ifndef _USED_INDEX_H_
+#define _USED_INDEX_H_
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace Sibelia
+{
+	// Bitset over the positions of a chromosome with summary levels on top:
+	// a bit of a level is set iff the corresponding word of the level below
+	// is not zero. The nearest set bit in either direction is found in
+	// O(log_64 n) word operations. A word is set before its summary bit, so
+	// a reader that sees a summary bit also sees a non-empty word below it.
+	// Bits are reset only while nobody reads the index
+	class UsedIndex
+	{
+	public:
+		static const int64_t NONE = -1;
+
+		UsedIndex()
+		{
+			Init(0);
+		}
+
+		void Init(size_t size)
+		{
+			level_.clear();
+			for (size_t words = size;;)
+			{
+				words = words > 64 ? (words + 63) / 64 : 1;
+				level_.push_back(std::vector<std::atomic<uint64_t> >(words));
+				for (auto & word : level_.back())
+				{
+					word.store(0);
+				}
+
+				if (words == 1)
+				{
+					break;
+				}
+			}
+		}
+
+		void Set(size_t bit)
+		{
+			for (size_t level = 0; level < level_.size(); level++, bit >>= 6)
+			{
+				if (level_[level][bit >> 6].fetch_or(uint64_t(1) << (bit & 63)) != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		void Reset(size_t bit)
+		{
+			for (size_t level = 0; level < level_.size(); level++, bit >>= 6)
+			{
+				if (level_[level][bit >> 6].fetch_and(~(uint64_t(1) << (bit & 63))) != (uint64_t(1) << (bit & 63)))
+				{
+					break;
+				}
+			}
+		}
+
+		bool Test(size_t bit) const
+		{
+			return (level_[0][bit >> 6].load() >> (bit & 63)) & 1;
+		}
+
+		// Returns the smallest set bit not less than from, or NONE
+		int64_t Next(int64_t from) const
+		{
+			if (from < 0)
+			{
+				from = 0;
+			}
+
+			size_t level = 0;
+			uint64_t bit = from;
+			for (;; level++)
+			{
+				if (level == level_.size())
+				{
+					return NONE;
+				}
+
+				uint64_t idx = bit >> 6;
+				if (idx < level_[level].size())
+				{
+					uint64_t word = level_[level][idx].load() & (~uint64_t(0) << (bit & 63));
+					if (word != 0)
+					{
+						bit = (idx << 6) + LowestBit(word);
+						break;
+					}
+				}
+
+				bit = idx + 1;
+			}
+
+			while (level > 0)
+			{
+				uint64_t word = level_[--level][bit].load();
+				assert(word != 0);
+				bit = (bit << 6) + LowestBit(word);
+			}
+
+			return bit;
+		}
+
+		// Returns the largest set bit not greater than from, or NONE
+		int64_t Prev(int64_t from) const
+		{
+			if (from < 0)
+			{
+				return NONE;
+			}
+
+			size_t level = 0;
+			uint64_t bit = from;
+			for (;; level++)
+			{
+				if (level == level_.size())
+				{
+					return NONE;
+				}
+
+				uint64_t idx = bit >> 6;
+				if (idx >= level_[level].size())
+				{
+					idx = level_[level].size() - 1;
+					bit = (idx << 6) + 63;
+				}
+
+				uint64_t word = level_[level][idx].load() & (~uint64_t(0) >> (63 - (bit & 63)));
+				if (word != 0)
+				{
+					bit = (idx << 6) + HighestBit(word);
+					break;
+				}
+
+				if (idx == 0)
+				{
+					return NONE;
+				}
+
+				bit = idx - 1;
+			}
+
+			while (level > 0)
+			{
+				uint64_t word = level_[--level][bit].load();
+				assert(word != 0);
+				bit = (bit << 6) + HighestBit(word);
+			}
+
+			return bit;
+		}
+
+	private:
+
+		static uint64_t LowestBit(uint64_t word)
+		{
+#ifdef _MSC_VER
+			unsigned long ret;
+			_BitScanForward64(&ret, word);
+			return ret;
+#else
+			return __builtin_ctzll(word);
+#endif
+		}
+
+		static uint64_t HighestBit(uint64_t word)
+		{
+#ifdef _MSC_VER
+			unsigned long ret;
+			_BitScanReverse64(&ret, word);
+			return ret;
+#else
+			return 63 - __builtin_clzll(word);
+#endif
+		}
+
+		std::vector<std::vector<std::atomic<uint64_t> > > level_;
+	};
+}
+
+#endif